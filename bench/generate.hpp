@@ -0,0 +1,59 @@
+#pragma once
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct GenerateOptions {
+  // Every `ladder_every`-th statement is an if/elif/else ladder with a
+  // nested scope; the others are lets.
+  size_t ladder_every = 4;
+  // Line comments between statements and a block comment at the end, for the
+  // lexer to skip.
+  bool comments = false;
+};
+
+struct Program {
+  std::string source;
+  // Offsets of two-digit literals that may be rewritten in place.
+  std::vector<size_t> literals;
+};
+
+// Program with `statements` top-level statements, each using the variable
+// the one before declared.
+inline Program generate(size_t statements, const GenerateOptions& options) {
+  Program program;
+  std::ostringstream source;
+  auto literal = [&](size_t i) {
+    program.literals.push_back(source.tellp());
+    source << 10 + i % 90;
+  };
+
+  source << "let v0 = 1;\n";
+  for (size_t i = 1; i < statements; ++i) {
+    if (options.comments && i % options.ladder_every == 1) {
+      source << "// step " << i << "\n";
+    }
+    if (i % options.ladder_every == 0) {
+      source << "if (v" << i - 1 << " - ";
+      literal(i);
+      source << ") {\n    let w" << i << " = (v" << i - 1
+             << " + 3) * 2;\n    {\n        v" << i - 1 << " = w" << i
+             << " / ";
+      literal(i + 1);
+      source << ";\n    }\n} elif (v" << i - 1 << ") {\n    v" << i - 1
+             << " = 2;\n} else {\n    v" << i - 1 << " = 7;\n}\n";
+      source << "let v" << i << " = v" << i - 1 << ";\n";
+    } else {
+      source << "let v" << i << " = v" << i - 1 << " * 3 + ";
+      literal(i);
+      source << " - (v" << i - 1 << " / 7 + 1);\n";
+    }
+  }
+  if (options.comments) {
+    source << "/* end */\n";
+  }
+  source << "exit(v" << statements - 1 << ");\n";
+  program.source = source.str();
+  return program;
+}
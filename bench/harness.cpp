@@ -0,0 +1,486 @@
+// Generated-code quality harness: compiles every program in the corpus with
+// hydro, checks its exit code, and records static instruction count, binary
+// size, runtime and (where perf_event_open is permitted) user-space
+// instruction and cycle counts. Results are written as JSON and compared
+// against a saved baseline; only the deterministic metrics can fail the run.
+//
+// `cmake --build <dir> --target bench` runs it over bench/corpus; copy the
+// resulting <dir>/bench.json to bench/baseline.json to record a baseline.
+// Each corpus program states its expected exit status in a
+// `// expect: <status>` line.
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+using Metrics = std::map<std::string, std::optional<double>>;
+using Report = std::map<std::string, Metrics>;
+
+struct Options {
+  std::string hydro;
+  std::string corpus;
+  std::vector<std::string> hydro_flags;
+  std::optional<std::string> baseline;
+  std::optional<std::string> out;
+  fs::path work_dir = fs::temp_directory_path() / "hydro-bench";
+  int runs = 20;
+  bool pgo = false;
+};
+
+// Lower is better for every metric, and the rest must not grow. The corpus
+// programs finish in microseconds, so wall-clock time is mostly fork and exec
+// and cycles vary with the machine's state; these are reported but never
+// counted as regressions.
+const std::vector<std::string> INFORMATIONAL_METRICS = {"runtime_ns",
+                                                        "cycles"};
+
+std::optional<int> expected_exit(const fs::path& program) {
+  std::ifstream input(program);
+  std::string line;
+  const std::string marker = "// expect:";
+  while (std::getline(input, line)) {
+    if (line.starts_with(marker)) {
+      return std::stoi(line.substr(marker.size()));
+    }
+  }
+  return {};
+}
+
+// Runs argv in `dir` and returns its exit status, or -1 if it did not exit
+// normally.
+int run(const std::vector<std::string>& argv, const fs::path& dir,
+        bool quiet = false) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (chdir(dir.c_str()) != 0) {
+      _exit(127);
+    }
+    if (quiet) {
+      int null = open("/dev/null", O_WRONLY);
+      dup2(null, STDOUT_FILENO);
+      dup2(null, STDERR_FILENO);
+    }
+    std::vector<char*> args;
+    for (const auto& arg : argv) {
+      args.push_back(const_cast<char*>(arg.c_str()));
+    }
+    args.push_back(nullptr);
+    execvp(args[0], args.data());
+    _exit(127);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int open_counter(pid_t pid, uint64_t config) {
+  perf_event_attr attr{};
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return static_cast<int>(syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0));
+}
+
+struct Sample {
+  int status;
+  double runtime_ns;
+  std::optional<double> instructions;
+  std::optional<double> cycles;
+};
+
+// Runs the compiled binary once. The child blocks on a pipe until the
+// counters are attached, so they only see the program after exec.
+Sample run_binary(const fs::path& dir) {
+  int gate[2];
+  if (pipe(gate) != 0) {
+    std::cerr << "pipe failed" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(gate[1]);
+    char c;
+    if (read(gate[0], &c, 1) != 1 || chdir(dir.c_str()) != 0) {
+      _exit(127);
+    }
+    execl("./out", "./out", nullptr);
+    _exit(127);
+  }
+  close(gate[0]);
+
+  int instructions = open_counter(pid, PERF_COUNT_HW_INSTRUCTIONS);
+  int cycles = open_counter(pid, PERF_COUNT_HW_CPU_CYCLES);
+
+  auto start = std::chrono::steady_clock::now();
+  if (write(gate[1], "x", 1) != 1) {
+    std::cerr << "write failed" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  close(gate[1]);
+  int status;
+  waitpid(pid, &status, 0);
+  auto end = std::chrono::steady_clock::now();
+
+  auto read_counter = [](int fd) -> std::optional<double> {
+    uint64_t value;
+    if (fd < 0) {
+      return {};
+    }
+    ssize_t n = read(fd, &value, sizeof(value));
+    close(fd);
+    if (n != sizeof(value)) {
+      return {};
+    }
+    return static_cast<double>(value);
+  };
+
+  return {
+      .status = WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+      .runtime_ns = static_cast<double>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+              .count()),
+      .instructions = read_counter(instructions),
+      .cycles = read_counter(cycles),
+  };
+}
+
+// Instructions in the generated assembly, excluding labels, directives and
+// the data section.
+double static_instructions(const fs::path& asm_path) {
+  std::ifstream input(asm_path);
+  std::string line;
+  double count = 0;
+  while (std::getline(input, line)) {
+    if (line.starts_with("section .data")) {
+      break;
+    }
+    if (line.starts_with("    ")) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+double median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+std::optional<Metrics> measure(const Options& options, const fs::path& program,
+                               int expected) {
+  const fs::path dir = options.work_dir / program.stem();
+  fs::create_directories(dir);
+  const std::string source = fs::absolute(program).string();
+
+  std::vector<std::string> compile = {options.hydro};
+  compile.insert(compile.end(), options.hydro_flags.begin(),
+                 options.hydro_flags.end());
+
+  if (options.pgo) {
+    const std::string profile = (dir / "bench.prof").string();
+    std::vector<std::string> instrumented = compile;
+    instrumented.push_back("--profile-generate=" + profile);
+    instrumented.push_back(source);
+    if (run(instrumented, dir, true) != 0 || run_binary(dir).status < 0) {
+      std::cerr << program.stem().string() << ": training run failed"
+                << std::endl;
+      return {};
+    }
+    compile.push_back("--profile-use=" + profile);
+  }
+
+  compile.push_back(source);
+  fs::remove(dir / "out");
+  fs::remove(dir / "out.o");
+  if (run(compile, dir, true) != 0 || !fs::exists(dir / "out")) {
+    std::cerr << program.stem().string() << ": compilation failed"
+              << std::endl;
+    return {};
+  }
+
+  std::vector<double> runtimes;
+  std::vector<double> instructions;
+  std::vector<double> cycles;
+  for (int i = 0; i < options.runs; ++i) {
+    Sample sample = run_binary(dir);
+    if (sample.status != expected) {
+      std::cerr << program.stem().string() << ": exited with "
+                << sample.status << ", expected " << expected << std::endl;
+      return {};
+    }
+    runtimes.push_back(sample.runtime_ns);
+    if (sample.instructions.has_value()) {
+      instructions.push_back(sample.instructions.value());
+    }
+    if (sample.cycles.has_value()) {
+      cycles.push_back(sample.cycles.value());
+    }
+  }
+
+  Metrics metrics;
+  metrics["static_instructions"] = static_instructions(dir / "out.asm");
+  metrics["binary_size"] = static_cast<double>(fs::file_size(dir / "out"));
+  metrics["runtime_ns"] = *std::min_element(runtimes.begin(), runtimes.end());
+  metrics["instructions"] = instructions.empty()
+                                ? std::nullopt
+                                : std::optional<double>(median(instructions));
+  metrics["cycles"] =
+      cycles.empty() ? std::nullopt : std::optional<double>(median(cycles));
+  return metrics;
+}
+
+void write_report(std::ostream& out, const Report& report) {
+  out << "{\n";
+  for (auto it = report.begin(); it != report.end(); ++it) {
+    out << "  \"" << it->first << "\": {";
+    for (auto m = it->second.begin(); m != it->second.end(); ++m) {
+      out << (m == it->second.begin() ? "" : ", ") << "\"" << m->first
+          << "\": ";
+      if (m->second.has_value()) {
+        out << std::fixed << std::setprecision(0) << m->second.value();
+      } else {
+        out << "null";
+      }
+    }
+    out << "}" << (std::next(it) == report.end() ? "" : ",") << "\n";
+  }
+  out << "}\n";
+}
+
+// Reads back the two-level object written by write_report.
+class ReportReader {
+ private:
+  const std::string m_src;
+  size_t m_index = 0;
+
+  void skip_ws() {
+    while (m_index < m_src.size() && std::isspace(m_src[m_index])) {
+      ++m_index;
+    }
+  }
+
+  void expect(char c) {
+    skip_ws();
+    if (m_index >= m_src.size() || m_src[m_index] != c) {
+      std::cerr << "Malformed baseline: expected '" << c << "' at offset "
+                << m_index << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    ++m_index;
+  }
+
+  bool try_consume(char c) {
+    skip_ws();
+    if (m_index < m_src.size() && m_src[m_index] == c) {
+      ++m_index;
+      return true;
+    }
+    return false;
+  }
+
+  std::string parse_string() {
+    expect('"');
+    size_t end = m_src.find('"', m_index);
+    std::string value = m_src.substr(m_index, end - m_index);
+    m_index = end + 1;
+    return value;
+  }
+
+  std::optional<double> parse_number() {
+    skip_ws();
+    if (m_src.compare(m_index, 4, "null") == 0) {
+      m_index += 4;
+      return {};
+    }
+    size_t length;
+    double value = std::stod(m_src.substr(m_index), &length);
+    m_index += length;
+    return value;
+  }
+
+  template <typename Value, typename Parse>
+  std::map<std::string, Value> parse_object(Parse parse) {
+    std::map<std::string, Value> object;
+    expect('{');
+    if (try_consume('}')) {
+      return object;
+    }
+    do {
+      std::string key = parse_string();
+      expect(':');
+      object[key] = parse();
+    } while (try_consume(','));
+    expect('}');
+    return object;
+  }
+
+ public:
+  explicit ReportReader(std::string src) : m_src(std::move(src)) {}
+
+  Report parse() {
+    return parse_object<Metrics>([&] {
+      return parse_object<std::optional<double>>(
+          [&] { return parse_number(); });
+    });
+  }
+};
+
+// Prints every metric next to its baseline and returns whether anything
+// regressed.
+bool compare(const Report& baseline, const Report& current) {
+  bool regressed = false;
+  std::cout << std::left << std::setw(20) << "program" << std::setw(22)
+            << "metric" << std::right << std::setw(14) << "baseline"
+            << std::setw(14) << "current" << std::setw(10) << "delta"
+            << "\n";
+  for (const auto& [program, metrics] : current) {
+    auto base = baseline.find(program);
+    for (const auto& [metric, value] : metrics) {
+      std::optional<double> before;
+      if (base != baseline.end() && base->second.contains(metric)) {
+        before = base->second.at(metric);
+      }
+      std::cout << std::left << std::setw(20) << program << std::setw(22)
+                << metric << std::right << std::fixed << std::setprecision(0)
+                << std::setw(14);
+      if (before.has_value()) {
+        std::cout << before.value();
+      } else {
+        std::cout << "-";
+      }
+      std::cout << std::setw(14);
+      if (value.has_value()) {
+        std::cout << value.value();
+      } else {
+        std::cout << "-";
+      }
+      if (!before.has_value() || !value.has_value() || before.value() == 0) {
+        std::cout << "\n";
+        continue;
+      }
+      const double delta = (value.value() - before.value()) / before.value();
+      const bool informational =
+          std::find(INFORMATIONAL_METRICS.begin(), INFORMATIONAL_METRICS.end(),
+                    metric) != INFORMATIONAL_METRICS.end();
+      const bool worse = !informational && delta > 0;
+      std::cout << std::setw(9) << std::setprecision(1) << std::showpos
+                << delta * 100 << std::noshowpos << "%"
+                << (worse ? "  REGRESSION" : "") << "\n";
+      regressed |= worse;
+    }
+  }
+  return regressed;
+}
+
+void usage() {
+  std::cerr << "Usage: hydro-bench --hydro <path> --corpus <dir> [--runs N]\n"
+               "                   [--baseline <json>] [--out <json>]\n"
+               "                   [--work-dir <dir>]\n"
+               "                   [--pgo] [--flag <hydro option>]..."
+            << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) {
+        usage();
+        exit(EXIT_FAILURE);
+      }
+      return argv[++i];
+    };
+    if (arg == "--hydro") {
+      options.hydro = fs::absolute(value()).string();
+    } else if (arg == "--corpus") {
+      options.corpus = value();
+    } else if (arg == "--runs") {
+      options.runs = std::max(1, std::stoi(value()));
+    } else if (arg == "--baseline") {
+      options.baseline = value();
+    } else if (arg == "--out") {
+      options.out = value();
+    } else if (arg == "--work-dir") {
+      options.work_dir = fs::absolute(value());
+    } else if (arg == "--pgo") {
+      options.pgo = true;
+    } else if (arg == "--flag") {
+      options.hydro_flags.push_back(value());
+    } else {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+  if (options.hydro.empty() || options.corpus.empty()) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  std::vector<fs::path> programs;
+  for (const auto& entry : fs::directory_iterator(options.corpus)) {
+    if (entry.path().extension() == ".hy") {
+      programs.push_back(entry.path());
+    }
+  }
+  std::sort(programs.begin(), programs.end());
+
+  Report report;
+  bool failed = false;
+  for (const auto& program : programs) {
+    auto expected = expected_exit(program);
+    if (!expected.has_value()) {
+      std::cerr << program.stem().string() << ": missing '// expect:' line"
+                << std::endl;
+      failed = true;
+      continue;
+    }
+    if (auto metrics = measure(options, program, expected.value())) {
+      report[program.stem().string()] = metrics.value();
+    } else {
+      failed = true;
+    }
+  }
+
+  if (options.out.has_value()) {
+    std::ofstream out(options.out.value());
+    write_report(out, report);
+  } else {
+    write_report(std::cout, report);
+  }
+
+  if (options.baseline.has_value()) {
+    if (fs::exists(options.baseline.value())) {
+      std::stringstream buffer;
+      buffer << std::ifstream(options.baseline.value()).rdbuf();
+      const Report baseline = ReportReader(buffer.str()).parse();
+      failed |= compare(baseline, report);
+    } else {
+      std::cerr << "No baseline at " << options.baseline.value()
+                << "; copy the report there to start tracking" << std::endl;
+    }
+  }
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,119 @@
+// Edit latency of the incremental compiler against a full rebuild, over
+// generated programs of growing size. Each program is a long run of
+// top-level lets and if/elif/else ladders; every edit changes a literal at top
+// level or inside a ladder arm, or inserts and later removes whitespace.
+// The median edit should stay flat while the full rebuild grows with the
+// file. Watch mode also writes the assembly out after each edit, which is
+// linear in the file, so that is timed as a separate column.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "generate.hpp"
+#include "generator.hpp"
+#include "incremental.hpp"
+#include "parser.hpp"
+#include "tokenizer.hpp"
+
+double micros(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+double full_build_us(const std::string& source) {
+  const auto start = std::chrono::steady_clock::now();
+  Tokenizer tokenizer(source);
+  Parser parser(tokenizer.tokenize());
+  Generator generator(parser.parse_prog().value());
+  const std::string assembly = generator.gen_prog();
+  return micros(std::chrono::steady_clock::now() - start);
+}
+
+void usage() {
+  std::cerr << "Usage: hydro-incremental-bench [--sizes N,N,...] [--edits N]"
+            << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  std::vector<size_t> sizes = {500, 2000, 8000};
+  size_t edits = 300;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--sizes" && i + 1 < argc) {
+      sizes.clear();
+      std::stringstream list(argv[++i]);
+      std::string size;
+      while (std::getline(list, size, ',')) {
+        sizes.push_back(std::stoul(size));
+      }
+    } else if (arg == "--edits" && i + 1 < argc) {
+      edits = std::max(1, std::stoi(argv[++i]));
+    } else {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::cout << std::setw(12) << "statements" << std::setw(12) << "bytes"
+            << std::setw(16) << "full build us" << std::setw(16)
+            << "edit median us" << std::setw(14) << "edit p95 us"
+            << std::setw(20) << "edit+asm median us" << std::endl;
+  for (const size_t size : sizes) {
+    Program program =
+        generate(std::max<size_t>(size, 2), {.ladder_every = 5});
+    std::vector<double> full;
+    for (int run = 0; run < 3; ++run) {
+      full.push_back(full_build_us(program.source));
+    }
+    std::sort(full.begin(), full.end());
+
+    IncrementalCompiler compiler(program.source);
+    uint64_t seed = 0x9e3779b97f4a7c15;
+    auto random = [&](size_t bound) {
+      seed = seed * 6364136223846793005 + 1442695040888963407;
+      return static_cast<size_t>(seed >> 33) % bound;
+    };
+
+    std::vector<double> latencies;
+    std::vector<double> with_assembly;
+    std::optional<size_t> pending_space;
+    for (size_t i = 0; i < edits; ++i) {
+      TextEdit edit;
+      if (pending_space.has_value()) {
+        edit = {.offset = pending_space.value(), .removed = 1, .inserted = ""};
+        pending_space.reset();
+      } else if (i % 4 == 3) {
+        // Literal offsets stay valid since the space is removed right after.
+        const size_t offset = program.literals[random(program.literals.size())];
+        edit = {.offset = offset, .removed = 0, .inserted = " "};
+        pending_space = offset;
+      } else {
+        edit = {.offset = program.literals[random(program.literals.size())],
+                .removed = 2,
+                .inserted = std::to_string(10 + random(90))};
+      }
+      const auto start = std::chrono::steady_clock::now();
+      compiler.apply(edit);
+      latencies.push_back(micros(std::chrono::steady_clock::now() - start));
+      std::ostringstream assembly;
+      compiler.write_assembly(assembly);
+      with_assembly.push_back(micros(std::chrono::steady_clock::now() - start));
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::sort(with_assembly.begin(), with_assembly.end());
+
+    std::cout << std::fixed << std::setprecision(1) << std::setw(12) << size
+              << std::setw(12) << program.source.size() << std::setw(16)
+              << full[full.size() / 2] << std::setw(16)
+              << latencies[latencies.size() / 2] << std::setw(14)
+              << latencies[latencies.size() * 95 / 100] << std::setw(20)
+              << with_assembly[with_assembly.size() / 2] << std::endl;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+// Front-end time of the pipelined lexer and parser against lexing and then
+// parsing on one thread, over generated programs of growing size or the
+// given source files. Each pipelined tree is written with AstBinWriter and
+// compared byte for byte with the serial one, so a mismatch in any node,
+// string or line fails the run.
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ast_bin.hpp"
+#include "generate.hpp"
+#include "parser.hpp"
+#include "source.hpp"
+#include "token_queue.hpp"
+#include "tokenizer.hpp"
+
+std::string serialize(const NodeProg* prog) {
+  std::ostringstream output;
+  AstBinWriter(prog).write(output);
+  return output.str();
+}
+
+double millis(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+struct Run {
+  double ms;
+  std::string ast;
+};
+
+Run serial(const std::string& source) {
+  const auto start = std::chrono::steady_clock::now();
+  Tokenizer tokenizer(source);
+  Parser parser(tokenizer.tokenize());
+  const NodeProg* prog = parser.parse_prog().value();
+  return {millis(std::chrono::steady_clock::now() - start), serialize(prog)};
+}
+
+Run pipelined(const std::string& source) {
+  const auto start = std::chrono::steady_clock::now();
+  TokenQueue queue;
+  TokenProducer producer(Tokenizer(source), queue);
+  Parser parser(queue);
+  const NodeProg* prog = parser.parse_prog().value();
+  return {millis(std::chrono::steady_clock::now() - start), serialize(prog)};
+}
+
+double median(std::vector<double> times) {
+  std::sort(times.begin(), times.end());
+  return times[times.size() / 2];
+}
+
+void usage() {
+  std::cerr << "Usage: hydro-pipeline-bench [--sizes N,N,...] [--runs N] "
+               "[file.hy...]"
+            << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  std::vector<size_t> sizes = {20000, 80000, 320000};
+  std::vector<std::string> files;
+  int runs = 5;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--sizes" && i + 1 < argc) {
+      sizes.clear();
+      std::stringstream list(argv[++i]);
+      std::string size;
+      while (std::getline(list, size, ',')) {
+        sizes.push_back(std::stoul(size));
+      }
+    } else if (arg == "--runs" && i + 1 < argc) {
+      runs = std::max(1, std::stoi(argv[++i]));
+    } else if (arg.starts_with("--")) {
+      usage();
+      return EXIT_FAILURE;
+    } else {
+      files.push_back(arg);
+    }
+  }
+
+  std::vector<std::pair<std::string, std::string>> inputs;
+  if (files.empty()) {
+    for (const size_t size : sizes) {
+      Program program =
+          generate(std::max<size_t>(size, 2), {.comments = true});
+      inputs.emplace_back(std::to_string(size) + " statements",
+                          std::move(program.source));
+    }
+  } else {
+    for (const std::string& file : files) {
+      inputs.emplace_back(file, read_file(file));
+    }
+  }
+
+  std::cout << "hardware threads: " << std::thread::hardware_concurrency()
+            << std::endl;
+  std::cout << std::left << std::setw(24) << "input" << std::right
+            << std::setw(12) << "MB" << std::setw(12) << "serial ms"
+            << std::setw(14) << "pipelined ms" << std::setw(10) << "speedup"
+            << std::setw(8) << "ast" << std::endl;
+  bool identical = true;
+  for (const auto& [name, source] : inputs) {
+    std::vector<double> serial_ms;
+    std::vector<double> pipelined_ms;
+    bool same = true;
+    for (int run = 0; run < runs; ++run) {
+      Run expected = serial(source);
+      Run actual = pipelined(source);
+      serial_ms.push_back(expected.ms);
+      pipelined_ms.push_back(actual.ms);
+      same &= expected.ast == actual.ast;
+    }
+    identical &= same;
+
+    std::cout << std::fixed << std::setprecision(1) << std::left
+              << std::setw(24) << name << std::right << std::setw(12)
+              << source.size() / 1e6 << std::setw(12) << median(serial_ms)
+              << std::setw(14) << median(pipelined_ms) << std::setw(9)
+              << std::setprecision(2)
+              << median(serial_ms) / median(pipelined_ms) << "x"
+              << std::setw(8) << (same ? "same" : "DIFF") << std::endl;
+  }
+
+  if (!identical) {
+    std::cerr << "Pipelined AST differs from the serial one" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
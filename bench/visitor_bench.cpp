@@ -0,0 +1,328 @@
+// Cost of walking the tree with std::visit against dispatch() and
+// AstWalker. Every walker does the same work as a small analysis pass: it
+// counts identifiers and sums the lengths of integer literals over a
+// generated program. Build with optimizations for meaningful numbers.
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "generate.hpp"
+#include "parser.hpp"
+#include "tokenizer.hpp"
+#include "visitor.hpp"
+
+struct Totals {
+  size_t idents = 0;
+  size_t digits = 0;
+  size_t nodes = 0;
+
+  bool operator==(const Totals&) const = default;
+};
+
+// The visitor structs the passes were written with before dispatch().
+class StdVisitCounter {
+ private:
+  Totals m_totals{};
+
+  void count_expr(const NodeExpr* expr) {
+    struct TermVisitor {
+      StdVisitCounter& counter;
+
+      void operator()(const NodeTermIntLit* term_int_lit) const {
+        counter.m_totals.digits += term_int_lit->int_lit.value->size();
+      }
+      void operator()(const NodeTermIdent*) const {
+        ++counter.m_totals.idents;
+      }
+      void operator()(const NodeTermParen* term_paren) const {
+        counter.count_expr(term_paren->expr);
+      }
+    };
+    struct ExprVisitor {
+      StdVisitCounter& counter;
+
+      void operator()(const NodeTerm* term) const {
+        ++counter.m_totals.nodes;
+        std::visit(TermVisitor({.counter = counter}), term->var);
+      }
+      void operator()(const NodeBinExpr* bin_expr) const {
+        ++counter.m_totals.nodes;
+        std::visit(
+            [&](const auto* bin) {
+              counter.count_expr(bin->rhs);
+              counter.count_expr(bin->lhs);
+            },
+            bin_expr->var);
+      }
+    };
+
+    ++m_totals.nodes;
+    std::visit(ExprVisitor({.counter = *this}), expr->var);
+  }
+
+  void count_scope(const NodeScope* scope) {
+    ++m_totals.nodes;
+    for (const NodeStmt* stmt : scope->stmts) {
+      count_stmt(stmt);
+    }
+  }
+
+  void count_if_pred(const NodeIfPred* pred) {
+    struct PredVisitor {
+      StdVisitCounter& counter;
+
+      void operator()(const NodeIfPredElif* _elif) const {
+        counter.count_expr(_elif->expr);
+        counter.count_scope(_elif->scope);
+        if (_elif->pred.has_value()) {
+          counter.count_if_pred(_elif->pred.value());
+        }
+      }
+      void operator()(const NodeIfPredElse* _else) const {
+        counter.count_scope(_else->scope);
+      }
+    };
+
+    ++m_totals.nodes;
+    std::visit(PredVisitor({.counter = *this}), pred->var);
+  }
+
+  void count_stmt(const NodeStmt* stmt) {
+    struct StmtVisitor {
+      StdVisitCounter& counter;
+
+      void operator()(const NodeStmtExit* stmt_exit) const {
+        counter.count_expr(stmt_exit->expr);
+      }
+      void operator()(const NodeStmtLet* stmt_let) const {
+        counter.count_expr(stmt_let->expr);
+      }
+      void operator()(const NodeScope* stmt_scope) const {
+        counter.count_scope(stmt_scope);
+      }
+      void operator()(const NodeStmtIf* stmt_if) const {
+        counter.count_expr(stmt_if->expr);
+        counter.count_scope(stmt_if->scope);
+        if (stmt_if->pred.has_value()) {
+          counter.count_if_pred(stmt_if->pred.value());
+        }
+      }
+      void operator()(const NodeStmtReAssign* assign) const {
+        counter.count_expr(assign->expr);
+      }
+    };
+
+    ++m_totals.nodes;
+    std::visit(StmtVisitor({.counter = *this}), stmt->var);
+  }
+
+ public:
+  Totals count(const NodeProg* prog) {
+    m_totals = {};
+    for (const NodeStmt* stmt : prog->stmts) {
+      count_stmt(stmt);
+    }
+    return m_totals;
+  }
+};
+
+// The same pass with every std::visit replaced by dispatch().
+class DispatchCounter {
+ private:
+  Totals m_totals{};
+
+  void count_expr(const NodeExpr* expr) {
+    struct TermVisitor {
+      DispatchCounter& counter;
+
+      void operator()(const NodeTermIntLit* term_int_lit) const {
+        counter.m_totals.digits += term_int_lit->int_lit.value->size();
+      }
+      void operator()(const NodeTermIdent*) const {
+        ++counter.m_totals.idents;
+      }
+      void operator()(const NodeTermParen* term_paren) const {
+        counter.count_expr(term_paren->expr);
+      }
+    };
+    struct ExprVisitor {
+      DispatchCounter& counter;
+
+      void operator()(const NodeTerm* term) const {
+        ++counter.m_totals.nodes;
+        dispatch(term->var, TermVisitor({.counter = counter}));
+      }
+      void operator()(const NodeBinExpr* bin_expr) const {
+        ++counter.m_totals.nodes;
+        dispatch(bin_expr->var, [&](const auto* bin) {
+          counter.count_expr(bin->rhs);
+          counter.count_expr(bin->lhs);
+        });
+      }
+    };
+
+    ++m_totals.nodes;
+    dispatch(expr->var, ExprVisitor({.counter = *this}));
+  }
+
+  void count_scope(const NodeScope* scope) {
+    ++m_totals.nodes;
+    for (const NodeStmt* stmt : scope->stmts) {
+      count_stmt(stmt);
+    }
+  }
+
+  void count_if_pred(const NodeIfPred* pred) {
+    struct PredVisitor {
+      DispatchCounter& counter;
+
+      void operator()(const NodeIfPredElif* _elif) const {
+        counter.count_expr(_elif->expr);
+        counter.count_scope(_elif->scope);
+        if (_elif->pred.has_value()) {
+          counter.count_if_pred(_elif->pred.value());
+        }
+      }
+      void operator()(const NodeIfPredElse* _else) const {
+        counter.count_scope(_else->scope);
+      }
+    };
+
+    ++m_totals.nodes;
+    dispatch(pred->var, PredVisitor({.counter = *this}));
+  }
+
+  void count_stmt(const NodeStmt* stmt) {
+    struct StmtVisitor {
+      DispatchCounter& counter;
+
+      void operator()(const NodeStmtExit* stmt_exit) const {
+        counter.count_expr(stmt_exit->expr);
+      }
+      void operator()(const NodeStmtLet* stmt_let) const {
+        counter.count_expr(stmt_let->expr);
+      }
+      void operator()(const NodeScope* stmt_scope) const {
+        counter.count_scope(stmt_scope);
+      }
+      void operator()(const NodeStmtIf* stmt_if) const {
+        counter.count_expr(stmt_if->expr);
+        counter.count_scope(stmt_if->scope);
+        if (stmt_if->pred.has_value()) {
+          counter.count_if_pred(stmt_if->pred.value());
+        }
+      }
+      void operator()(const NodeStmtReAssign* assign) const {
+        counter.count_expr(assign->expr);
+      }
+    };
+
+    ++m_totals.nodes;
+    dispatch(stmt->var, StmtVisitor({.counter = *this}));
+  }
+
+ public:
+  Totals count(const NodeProg* prog) {
+    m_totals = {};
+    for (const NodeStmt* stmt : prog->stmts) {
+      count_stmt(stmt);
+    }
+    return m_totals;
+  }
+};
+
+// The same pass as AstWalker hooks.
+class WalkerCounter : AstWalker<WalkerCounter> {
+ private:
+  friend AstWalker<WalkerCounter>;
+
+  Totals m_totals{};
+
+  void pre(const NodeTermIntLit* term_int_lit) {
+    m_totals.digits += term_int_lit->int_lit.value->size();
+  }
+  void pre(const NodeTermIdent*) { ++m_totals.idents; }
+  void pre(const NodeExpr*) { ++m_totals.nodes; }
+  void pre(const NodeTerm*) { ++m_totals.nodes; }
+  void pre(const NodeBinExpr*) { ++m_totals.nodes; }
+  void pre(const NodeScope*) { ++m_totals.nodes; }
+  void pre(const NodeIfPred*) { ++m_totals.nodes; }
+  void pre(const NodeStmt*) { ++m_totals.nodes; }
+
+ public:
+  Totals count(const NodeProg* prog) {
+    m_totals = {};
+    walk(prog);
+    return m_totals;
+  }
+};
+
+template <typename Counter>
+double time_ms(const NodeProg* prog, int runs, Totals& totals) {
+  Counter counter;
+  std::vector<double> times;
+  for (int run = 0; run < runs; ++run) {
+    const auto start = std::chrono::steady_clock::now();
+    totals = counter.count(prog);
+    times.push_back(std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count());
+  }
+  std::sort(times.begin(), times.end());
+  return times[times.size() / 2];
+}
+
+void usage() {
+  std::cerr << "Usage: hydro-visitor-bench [--statements N] [--runs N]"
+            << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  size_t statements = 200000;
+  int runs = 15;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--statements" && i + 1 < argc) {
+      statements = std::max<size_t>(2, std::stoul(argv[++i]));
+    } else if (arg == "--runs" && i + 1 < argc) {
+      runs = std::max(1, std::stoi(argv[++i]));
+    } else {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+
+  Tokenizer tokenizer(generate(statements, {.ladder_every = 3}).source);
+  Parser parser(tokenizer.tokenize());
+  const NodeProg* prog = parser.parse_prog().value();
+
+  Totals expected;
+  const double std_visit_ms = time_ms<StdVisitCounter>(prog, runs, expected);
+  Totals dispatched;
+  const double dispatch_ms = time_ms<DispatchCounter>(prog, runs, dispatched);
+  Totals walked;
+  const double walker_ms = time_ms<WalkerCounter>(prog, runs, walked);
+
+  if (!(dispatched == expected) || !(walked == expected)) {
+    std::cerr << "Walkers disagree on the totals" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  auto report = [&](const std::string& name, double ms) {
+    std::cout << std::left << std::setw(12) << name << std::right
+              << std::fixed << std::setprecision(2) << std::setw(10) << ms
+              << " ms" << std::setw(10) << ms * 1e6 / expected.nodes
+              << " ns/node" << std::setw(8) << std_visit_ms / ms << "x"
+              << std::endl;
+  };
+  std::cout << expected.nodes << " nodes, median of " << runs << " runs"
+            << std::endl;
+  report("std::visit", std_visit_ms);
+  report("dispatch", dispatch_ms);
+  report("AstWalker", walker_ms);
+  return EXIT_SUCCESS;
+}
@@ -1,25 +1,120 @@
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
 
 class ArenaAllocator {
  private:
+  struct Block {
+    std::byte* data;
+    size_t size;
+  };
+
+  // Nodes own strings and vectors, so their destructors are recorded and run
+  // when the arena is rewound or destroyed.
+  struct Destructor {
+    void* object;
+    void (*destroy)(void*);
+  };
+
   size_t m_size;
-  std::byte* m_buffer;
+  std::vector<Block> m_blocks;
+  size_t m_current = 0;
   std::byte* m_offset;
+  std::byte* m_end;
+  std::vector<Destructor> m_destructors;
+
+  // Moves on to the next block, reusing one kept from before a rewind when it
+  // is big enough.
+  void grow(size_t bytes) {
+    if (m_current + 1 < m_blocks.size() &&
+        m_blocks[m_current + 1].size >= bytes) {
+      ++m_current;
+    } else {
+      for (size_t i = m_current + 1; i < m_blocks.size(); ++i) {
+        free(m_blocks[i].data);
+      }
+      m_blocks.resize(m_current + 1);
+      m_blocks.push_back({static_cast<std::byte*>(malloc(bytes)), bytes});
+      m_current = m_blocks.size() - 1;
+    }
+    m_offset = m_blocks[m_current].data;
+    m_end = m_offset + m_blocks[m_current].size;
+  }
+
+  void destroy_from(size_t count) {
+    while (m_destructors.size() > count) {
+      const Destructor& destructor = m_destructors.back();
+      destructor.destroy(destructor.object);
+      m_destructors.pop_back();
+    }
+  }
 
  public:
+  // Allocation state to rewind to.
+  struct Mark {
+    size_t block;
+    std::byte* offset;
+    size_t destructors;
+  };
+
   ArenaAllocator(size_t bytes) : m_size(bytes) {
-    m_buffer = static_cast<std::byte*>(malloc(bytes));
-    m_offset = m_buffer;
+    m_blocks.push_back({static_cast<std::byte*>(malloc(bytes)), bytes});
+    m_offset = m_blocks.back().data;
+    m_end = m_offset + bytes;
   }
+  ArenaAllocator(const ArenaAllocator&) = delete;
+  ArenaAllocator& operator=(const ArenaAllocator&) = delete;
 
+  // Constructs a value-initialized T. Chains a new block when the current one
+  // is full, so large programs are not limited by the initial size.
   template <typename T>
   T* alloc() {
     void* offset = m_offset;
-    m_offset += sizeof(T);
-    return static_cast<T*>(offset);
+    size_t space = m_end - m_offset;
+    if (!std::align(alignof(T), sizeof(T), offset, space)) {
+      grow(std::max(m_size, sizeof(T) + alignof(T)));
+      offset = m_offset;
+      space = m_end - m_offset;
+      std::align(alignof(T), sizeof(T), offset, space);
+    }
+    m_offset = static_cast<std::byte*>(offset) + sizeof(T);
+    T* object = new (offset) T();
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      m_destructors.push_back(
+          {object, [](void* object) { static_cast<T*>(object)->~T(); }});
+    }
+    return object;
   }
 
-  ~ArenaAllocator() { free(m_buffer); }
+  Mark mark() const { return {m_current, m_offset, m_destructors.size()}; }
+
+  // Destroys everything allocated since `mark` and hands its memory back to
+  // later allocations. Blocks chained since then are kept for reuse.
+  void rewind(const Mark& mark) {
+    destroy_from(mark.destructors);
+    m_current = mark.block;
+    m_offset = mark.offset;
+    m_end = m_blocks[m_current].data + m_blocks[m_current].size;
+  }
+
+  // Bytes held in blocks, used or not.
+  size_t reserved() const {
+    size_t bytes = 0;
+    for (const Block& block : m_blocks) {
+      bytes += block.size;
+    }
+    return bytes;
+  }
+
+  ~ArenaAllocator() {
+    destroy_from(0);
+    for (const Block& block : m_blocks) {
+      free(block.data);
+    }
+  }
 };
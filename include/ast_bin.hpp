@@ -0,0 +1,513 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+#include "parser.hpp"
+#include "visitor.hpp"
+
+// Binary form of a parsed program, so a source can be parsed once and
+// handed to several code generation runs.
+//
+// The file is a header followed by four tables, every one 4-byte aligned:
+//   records  16-byte nodes in post-order, so children precede their parent
+//   lists    statement lists of scopes and the program
+//   strings  (offset, length) of every distinct identifier and literal
+//   blob     the bytes of those strings
+// A node refers to another by how many records it lies before it, so the
+// file has no pointers and can be mapped at any address; 0 means none.
+constexpr uint64_t AST_BIN_MAGIC = 0x3154534152445948;  // "HYDRAST1"
+
+enum class AstKind : uint8_t {
+  int_lit,   // a: string, b: line
+  ident,     // a: string, b: line
+  paren,     // a: expr
+  add,       // a: lhs, b: rhs
+  mul,       // a: lhs, b: rhs
+  sub,       // a: lhs, b: rhs
+  div,       // a: lhs, b: rhs
+  exit,      // a: expr
+  let,       // a: string, b: line, c: expr
+  reassign,  // a: string, b: line, c: expr
+  scope,     // a: first list entry, b: statement count
+  if_,       // a: expr, b: scope, c: pred
+  elif,      // a: expr, b: scope, c: pred
+  else_,     // a: scope
+  prog,      // a: first list entry, b: statement count; the last kind
+};
+
+struct AstRecord {
+  AstKind kind;
+  uint8_t pad[3];
+  uint32_t a;
+  uint32_t b;
+  uint32_t c;
+};
+
+struct AstBinHeader {
+  uint64_t magic;
+  uint32_t records;
+  uint32_t lists;
+  uint32_t strings;
+  uint32_t blob;
+};
+
+static_assert(sizeof(AstRecord) == 16 && sizeof(AstBinHeader) == 24);
+
+static_assert(static_cast<int>(AstKind::prog) < 32);
+
+// Only for kinds up to AstKind::prog; MappedAst rejects any other before it
+// gets here.
+constexpr uint32_t kind_bit(AstKind kind) {
+  return uint32_t{1} << static_cast<int>(kind);
+}
+
+class AstBinWriter {
+ private:
+  std::vector<AstRecord> m_records{};
+  std::vector<uint32_t> m_lists{};
+  std::unordered_map<std::string, uint32_t> m_interned{};
+  std::vector<uint32_t> m_strings{};
+  std::string m_blob{};
+
+  uint32_t intern(const std::string& text) {
+    auto [it, inserted] = m_interned.try_emplace(text, m_interned.size());
+    if (inserted) {
+      m_strings.push_back(m_blob.size());
+      m_strings.push_back(text.size());
+      m_blob += text;
+    }
+    return it->second;
+  }
+
+  // Appends a record and returns its index.
+  uint32_t add(AstKind kind, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0) {
+    m_records.push_back({.kind = kind, .pad = {}, .a = a, .b = b, .c = c});
+    return m_records.size() - 1;
+  }
+
+  uint32_t rel(uint32_t child) const { return m_records.size() - child; }
+
+  uint32_t write_list(AstKind kind, const std::vector<NodeStmt*>& stmts) {
+    std::vector<uint32_t> children;
+    for (const NodeStmt* stmt : stmts) {
+      children.push_back(write_stmt(stmt));
+    }
+    const uint32_t first = m_lists.size();
+    for (const uint32_t child : children) {
+      m_lists.push_back(rel(child));
+    }
+    return add(kind, first, children.size());
+  }
+
+  uint32_t write_expr(const NodeExpr* expr) {
+    struct ExprVisitor {
+      AstBinWriter& writer;
+
+      uint32_t operator()(const NodeTerm* term) const {
+        if (auto term_int_lit = std::get_if<NodeTermIntLit*>(&term->var)) {
+          const Token& token = (*term_int_lit)->int_lit;
+          return writer.add(AstKind::int_lit,
+                            writer.intern(token.value.value()), token.line);
+        } else if (auto term_ident = std::get_if<NodeTermIdent*>(&term->var)) {
+          const Token& token = (*term_ident)->ident;
+          return writer.add(AstKind::ident, writer.intern(token.value.value()),
+                            token.line);
+        }
+        const uint32_t expr =
+            writer.write_expr(std::get<NodeTermParen*>(term->var)->expr);
+        return writer.add(AstKind::paren, writer.rel(expr));
+      }
+      uint32_t operator()(const NodeBinExpr* bin_expr) const {
+        auto kind = dispatch(bin_expr->var, [](auto* bin) {
+          using Bin = std::remove_pointer_t<decltype(bin)>;
+          if constexpr (std::is_same_v<Bin, NodeBinExprAdd>) {
+            return AstKind::add;
+          } else if constexpr (std::is_same_v<Bin, NodeBinExprMul>) {
+            return AstKind::mul;
+          } else if constexpr (std::is_same_v<Bin, NodeBinExprSub>) {
+            return AstKind::sub;
+          } else {
+            return AstKind::div;
+          }
+        });
+        auto [lhs, rhs] = dispatch(bin_expr->var, [&](auto* bin) {
+          const uint32_t lhs = writer.write_expr(bin->lhs);
+          return std::pair{lhs, writer.write_expr(bin->rhs)};
+        });
+        return writer.add(kind, writer.rel(lhs), writer.rel(rhs));
+      }
+    };
+
+    ExprVisitor visitor({.writer = *this});
+    return dispatch(expr->var, visitor);
+  }
+
+  uint32_t write_if_pred(const NodeIfPred* pred) {
+    struct PredVisitor {
+      AstBinWriter& writer;
+
+      uint32_t operator()(const NodeIfPredElif* _elif) const {
+        const uint32_t expr = writer.write_expr(_elif->expr);
+        const uint32_t scope =
+            writer.write_list(AstKind::scope, _elif->scope->stmts);
+        std::optional<uint32_t> pred;
+        if (_elif->pred.has_value()) {
+          pred = writer.write_if_pred(_elif->pred.value());
+        }
+        return writer.add(AstKind::elif, writer.rel(expr), writer.rel(scope),
+                          pred ? writer.rel(pred.value()) : 0);
+      }
+      uint32_t operator()(const NodeIfPredElse* _else) const {
+        const uint32_t scope =
+            writer.write_list(AstKind::scope, _else->scope->stmts);
+        return writer.add(AstKind::else_, writer.rel(scope));
+      }
+    };
+
+    PredVisitor visitor({.writer = *this});
+    return dispatch(pred->var, visitor);
+  }
+
+  uint32_t write_stmt(const NodeStmt* stmt) {
+    struct StmtVisitor {
+      AstBinWriter& writer;
+
+      uint32_t operator()(const NodeStmtExit* stmt_exit) const {
+        const uint32_t expr = writer.write_expr(stmt_exit->expr);
+        return writer.add(AstKind::exit, writer.rel(expr));
+      }
+      uint32_t operator()(const NodeStmtLet* stmt_let) const {
+        const uint32_t expr = writer.write_expr(stmt_let->expr);
+        return writer.add(AstKind::let,
+                          writer.intern(stmt_let->ident.value.value()),
+                          stmt_let->ident.line, writer.rel(expr));
+      }
+      uint32_t operator()(const NodeScope* stmt_scope) const {
+        return writer.write_list(AstKind::scope, stmt_scope->stmts);
+      }
+      uint32_t operator()(const NodeStmtIf* stmt_if) const {
+        const uint32_t expr = writer.write_expr(stmt_if->expr);
+        const uint32_t scope =
+            writer.write_list(AstKind::scope, stmt_if->scope->stmts);
+        std::optional<uint32_t> pred;
+        if (stmt_if->pred.has_value()) {
+          pred = writer.write_if_pred(stmt_if->pred.value());
+        }
+        return writer.add(AstKind::if_, writer.rel(expr), writer.rel(scope),
+                          pred ? writer.rel(pred.value()) : 0);
+      }
+      uint32_t operator()(const NodeStmtReAssign* assign) const {
+        const uint32_t expr = writer.write_expr(assign->expr);
+        return writer.add(AstKind::reassign,
+                          writer.intern(assign->ident.value.value()),
+                          assign->ident.line, writer.rel(expr));
+      }
+    };
+
+    StmtVisitor visitor({.writer = *this});
+    return dispatch(stmt->var, visitor);
+  }
+
+ public:
+  explicit AstBinWriter(const NodeProg* prog) {
+    write_list(AstKind::prog, prog->stmts);
+  }
+
+  void write(std::ostream& output) const {
+    const AstBinHeader header{
+        .magic = AST_BIN_MAGIC,
+        .records = static_cast<uint32_t>(m_records.size()),
+        .lists = static_cast<uint32_t>(m_lists.size()),
+        .strings = static_cast<uint32_t>(m_interned.size()),
+        .blob = static_cast<uint32_t>(m_blob.size())};
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output.write(reinterpret_cast<const char*>(m_records.data()),
+                 m_records.size() * sizeof(AstRecord));
+    output.write(reinterpret_cast<const char*>(m_lists.data()),
+                 m_lists.size() * sizeof(uint32_t));
+    output.write(reinterpret_cast<const char*>(m_strings.data()),
+                 m_strings.size() * sizeof(uint32_t));
+    output.write(m_blob.data(), m_blob.size());
+  }
+};
+
+void write_ast_bin(const NodeProg* prog, const std::string& path) {
+  std::ofstream output(path, std::ios::out | std::ios::binary);
+  AstBinWriter(prog).write(output);
+  if (!output) {
+    std::cerr << "[AST] Could not write " << path << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Maps a file written by AstBinWriter and links the tree the passes walk in
+// one forward pass over the records. Children always precede their parent,
+// so every reference is to a node that already exists; nothing is tokenized
+// or parsed again.
+class MappedAst {
+ private:
+  const std::byte* m_data = nullptr;
+  size_t m_size = 0;
+  ArenaAllocator m_allocator;
+  NodeProg* m_prog = nullptr;
+
+  static constexpr uint32_t EXPR =
+      kind_bit(AstKind::int_lit) | kind_bit(AstKind::ident) |
+      kind_bit(AstKind::paren) | kind_bit(AstKind::add) |
+      kind_bit(AstKind::mul) | kind_bit(AstKind::sub) | kind_bit(AstKind::div);
+  static constexpr uint32_t SCOPE = kind_bit(AstKind::scope);
+  static constexpr uint32_t STMT = kind_bit(AstKind::exit) |
+                                   kind_bit(AstKind::let) |
+                                   kind_bit(AstKind::reassign) | SCOPE |
+                                   kind_bit(AstKind::if_);
+  static constexpr uint32_t PRED =
+      kind_bit(AstKind::elif) | kind_bit(AstKind::else_);
+
+  [[noreturn]] static void error(const std::string& path,
+                                 const std::string& msg) {
+    std::cerr << "[AST] " << path << ": " << msg << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  static size_t file_size(const std::string& path) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+      error(path, "cannot stat");
+    }
+    return info.st_size;
+  }
+
+  void link(const std::string& path) {
+    if (m_size < sizeof(AstBinHeader)) {
+      error(path, "truncated header");
+    }
+    const auto* header = reinterpret_cast<const AstBinHeader*>(m_data);
+    const uint64_t expected =
+        sizeof(AstBinHeader) + uint64_t{header->records} * sizeof(AstRecord) +
+        uint64_t{header->lists} * 4 + uint64_t{header->strings} * 8 +
+        header->blob;
+    if (header->magic != AST_BIN_MAGIC) {
+      error(path, "not a hydro AST file");
+    }
+    if (expected != m_size || header->records == 0) {
+      error(path, "corrupt or truncated");
+    }
+
+    const auto* records =
+        reinterpret_cast<const AstRecord*>(m_data + sizeof(AstBinHeader));
+    for (uint32_t i = 0; i < header->records; ++i) {
+      if (records[i].kind > AstKind::prog) {
+        error(path, "bad record kind " +
+                        std::to_string(static_cast<int>(records[i].kind)));
+      }
+    }
+    const auto* lists =
+        reinterpret_cast<const uint32_t*>(records + header->records);
+    const uint32_t* strings = lists + header->lists;
+    const char* blob =
+        reinterpret_cast<const char*>(strings + header->strings * 2);
+
+    // What each record became: a NodeExpr, NodeStmt, NodeScope or NodeIfPred.
+    std::vector<void*> nodes(header->records);
+
+    // Node `rel` records before `index`, which must be one of `kinds`.
+    auto child = [&](uint32_t index, uint32_t rel, uint32_t kinds) -> void* {
+      if (rel == 0 || rel > index ||
+          !(kinds & kind_bit(records[index - rel].kind))) {
+        error(path, "bad reference in record " + std::to_string(index));
+      }
+      return nodes[index - rel];
+    };
+
+    auto token = [&](TokenType type, uint32_t string, uint32_t line) {
+      if (string >= header->strings ||
+          uint64_t{strings[2 * string]} + strings[2 * string + 1] >
+              header->blob) {
+        error(path, "bad string " + std::to_string(string));
+      }
+      return Token{.type = type,
+                   .line = static_cast<int>(line),
+                   .value = std::string(blob + strings[2 * string],
+                                        strings[2 * string + 1])};
+    };
+    auto expr_of = [&](auto* node) {
+      auto expr = m_allocator.alloc<NodeExpr>();
+      if constexpr (std::is_same_v<decltype(node), NodeBinExpr*>) {
+        expr->var = node;
+      } else {
+        auto term = m_allocator.alloc<NodeTerm>();
+        term->var = node;
+        expr->var = term;
+      }
+      return expr;
+    };
+    auto bin_of = [&](auto* bin, const AstRecord& record, uint32_t index) {
+      bin->lhs = static_cast<NodeExpr*>(child(index, record.a, EXPR));
+      bin->rhs = static_cast<NodeExpr*>(child(index, record.b, EXPR));
+      auto bin_expr = m_allocator.alloc<NodeBinExpr>();
+      bin_expr->var = bin;
+      return expr_of(bin_expr);
+    };
+    auto stmts_of = [&](const AstRecord& record, uint32_t index) {
+      if (uint64_t{record.a} + record.b > header->lists) {
+        error(path, "bad list in record " + std::to_string(index));
+      }
+      std::vector<NodeStmt*> stmts;
+      stmts.reserve(record.b);
+      for (uint32_t i = record.a; i < record.a + record.b; ++i) {
+        void* node = child(index, lists[i], STMT);
+        if (records[index - lists[i]].kind == AstKind::scope) {
+          auto stmt = m_allocator.alloc<NodeStmt>();
+          stmt->var = static_cast<NodeScope*>(node);
+          node = stmt;
+        }
+        stmts.push_back(static_cast<NodeStmt*>(node));
+      }
+      return stmts;
+    };
+    auto pred_of = [&](uint32_t index, uint32_t rel) {
+      std::optional<NodeIfPred*> pred;
+      if (rel != 0) {
+        pred = static_cast<NodeIfPred*>(child(index, rel, PRED));
+      }
+      return pred;
+    };
+    auto stmt_of = [&](auto* node) {
+      auto stmt = m_allocator.alloc<NodeStmt>();
+      stmt->var = node;
+      return stmt;
+    };
+
+    for (uint32_t i = 0; i < header->records; ++i) {
+      const AstRecord& record = records[i];
+      switch (record.kind) {
+        case AstKind::int_lit: {
+          auto int_lit = m_allocator.alloc<NodeTermIntLit>();
+          int_lit->int_lit = token(TokenType::_int_lit, record.a, record.b);
+          nodes[i] = expr_of(int_lit);
+          break;
+        }
+        case AstKind::ident: {
+          auto ident = m_allocator.alloc<NodeTermIdent>();
+          ident->ident = token(TokenType::_ident, record.a, record.b);
+          nodes[i] = expr_of(ident);
+          break;
+        }
+        case AstKind::paren: {
+          auto paren = m_allocator.alloc<NodeTermParen>();
+          paren->expr = static_cast<NodeExpr*>(child(i, record.a, EXPR));
+          nodes[i] = expr_of(paren);
+          break;
+        }
+        case AstKind::add:
+          nodes[i] = bin_of(m_allocator.alloc<NodeBinExprAdd>(), record, i);
+          break;
+        case AstKind::mul:
+          nodes[i] = bin_of(m_allocator.alloc<NodeBinExprMul>(), record, i);
+          break;
+        case AstKind::sub:
+          nodes[i] = bin_of(m_allocator.alloc<NodeBinExprSub>(), record, i);
+          break;
+        case AstKind::div:
+          nodes[i] = bin_of(m_allocator.alloc<NodeBinExprDiv>(), record, i);
+          break;
+        case AstKind::exit: {
+          auto stmt_exit = m_allocator.alloc<NodeStmtExit>();
+          stmt_exit->expr = static_cast<NodeExpr*>(child(i, record.a, EXPR));
+          nodes[i] = stmt_of(stmt_exit);
+          break;
+        }
+        case AstKind::let: {
+          auto stmt_let = m_allocator.alloc<NodeStmtLet>();
+          stmt_let->ident = token(TokenType::_ident, record.a, record.b);
+          stmt_let->expr = static_cast<NodeExpr*>(child(i, record.c, EXPR));
+          nodes[i] = stmt_of(stmt_let);
+          break;
+        }
+        case AstKind::reassign: {
+          auto assign = m_allocator.alloc<NodeStmtReAssign>();
+          assign->ident = token(TokenType::_ident, record.a, record.b);
+          assign->expr = static_cast<NodeExpr*>(child(i, record.c, EXPR));
+          nodes[i] = stmt_of(assign);
+          break;
+        }
+        case AstKind::scope: {
+          auto scope = m_allocator.alloc<NodeScope>();
+          scope->stmts = stmts_of(record, i);
+          nodes[i] = scope;
+          break;
+        }
+        case AstKind::if_: {
+          auto stmt_if = m_allocator.alloc<NodeStmtIf>();
+          stmt_if->expr = static_cast<NodeExpr*>(child(i, record.a, EXPR));
+          stmt_if->scope = static_cast<NodeScope*>(child(i, record.b, SCOPE));
+          stmt_if->pred = pred_of(i, record.c);
+          nodes[i] = stmt_of(stmt_if);
+          break;
+        }
+        case AstKind::elif: {
+          auto _elif = m_allocator.alloc<NodeIfPredElif>();
+          _elif->expr = static_cast<NodeExpr*>(child(i, record.a, EXPR));
+          _elif->scope = static_cast<NodeScope*>(child(i, record.b, SCOPE));
+          _elif->pred = pred_of(i, record.c);
+          auto pred = m_allocator.alloc<NodeIfPred>();
+          pred->var = _elif;
+          nodes[i] = pred;
+          break;
+        }
+        case AstKind::else_: {
+          auto _else = m_allocator.alloc<NodeIfPredElse>();
+          _else->scope = static_cast<NodeScope*>(child(i, record.a, SCOPE));
+          auto pred = m_allocator.alloc<NodeIfPred>();
+          pred->var = _else;
+          nodes[i] = pred;
+          break;
+        }
+        case AstKind::prog:
+          if (i + 1 != header->records) {
+            error(path, "program record is not last");
+          }
+          m_prog = m_allocator.alloc<NodeProg>();
+          m_prog->stmts = stmts_of(record, i);
+          break;
+      }
+    }
+    if (!m_prog) {
+      error(path, "no program record");
+    }
+  }
+
+ public:
+  explicit MappedAst(const std::string& path)
+      : m_size(file_size(path)),
+        m_allocator(std::max<size_t>(4096, m_size * 8)) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      error(path, "cannot open");
+    }
+    void* data =
+        m_size > 0 ? mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                   : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) {
+      error(path, "cannot map");
+    }
+    m_data = static_cast<const std::byte*>(data);
+    link(path);
+  }
+
+  MappedAst(const MappedAst&) = delete;
+  MappedAst& operator=(const MappedAst&) = delete;
+
+  ~MappedAst() { munmap(const_cast<std::byte*>(m_data), m_size); }
+
+  const NodeProg* prog() const { return m_prog; }
+};
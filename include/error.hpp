@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdexcept>
+
+// An error in the program being compiled. The driver prints the message and
+// exits; watch mode reports it and keeps the last good build.
+class CompileError : public std::runtime_error {
+ public:
+  using std::runtime_error::runtime_error;
+};
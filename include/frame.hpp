@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "parser.hpp"
+#include "visitor.hpp"
+
+// Assigns every local a fixed rbp-relative slot before code generation.
+// Slots are handed out by scope depth, so sibling scopes (including the arms
+// of an if/elif/else ladder) reuse the same memory and the whole frame is
+// reserved by a single `sub rsp` in the prologue.
+class FrameLayout : AstWalker<FrameLayout> {
+ private:
+  friend AstWalker<FrameLayout>;
+
+  struct var {
+    std::string name;
+    size_t slot;
+  };
+
+  std::vector<var> m_vars{};
+  std::vector<size_t> m_scopes{};
+  std::unordered_map<const void*, size_t> m_slots{};
+  const std::unordered_map<std::string, size_t>* m_globals = nullptr;
+  const size_t m_global_slots = 0;
+  size_t m_frame_slots = 0;
+
+  // Top-level variable declared before the statements being laid out.
+  std::optional<size_t> global(const std::string& name) const {
+    if (!m_globals) {
+      return {};
+    }
+    auto it = m_globals->find(name);
+    if (it == m_globals->end() || it->second >= m_global_slots) {
+      return {};
+    }
+    return it->second;
+  }
+
+  void begin_scope() { m_scopes.push_back(m_vars.size()); }
+  void end_scope() {
+    m_vars.resize(m_scopes.back());
+    m_scopes.pop_back();
+  }
+
+  size_t lookup(const Token& ident) const {
+    auto it = std::find_if(m_vars.crbegin(), m_vars.crend(),
+                           [&](const var& _var) {
+                             return _var.name == ident.value.value();
+                           });
+    if (it != m_vars.crend()) {
+      return it->slot;
+    }
+    if (auto slot = global(ident.value.value())) {
+      return slot.value();
+    }
+    throw CompileError("Undeclared identifier: " + ident.value.value());
+  }
+
+  void declare(const NodeStmtLet* stmt_let) {
+    auto it = std::find_if(m_vars.cbegin(), m_vars.cend(),
+                           [&](const var& _var) {
+                             return _var.name == stmt_let->ident.value.value();
+                           });
+    if (it != m_vars.cend() || global(stmt_let->ident.value.value())) {
+      throw CompileError("Duplicate identifiers (" +
+                         stmt_let->ident.value.value() + ")");
+    }
+    const size_t slot = m_global_slots + m_vars.size();
+    m_vars.push_back({.name = stmt_let->ident.value.value(), .slot = slot});
+    m_slots[stmt_let] = slot;
+    m_frame_slots = std::max(m_frame_slots, slot + 1);
+  }
+
+  void pre(const NodeScope*) { begin_scope(); }
+  void post(const NodeScope*) { end_scope(); }
+  void pre(const NodeTermIdent* term_ident) {
+    m_slots[term_ident] = lookup(term_ident->ident);
+  }
+  // The initializer is laid out first, so it cannot see the new variable.
+  void post(const NodeStmtLet* stmt_let) { declare(stmt_let); }
+  void post(const NodeStmtReAssign* assign) {
+    m_slots[assign] = lookup(assign->ident);
+  }
+
+ public:
+  explicit FrameLayout(const NodeProg* prog) : FrameLayout(prog, nullptr, 0) {}
+  // Lays out statements that follow `global_slots` top-level variables
+  // declared elsewhere; `globals` maps their names to slots and may also hold
+  // later ones, which are ignored.
+  FrameLayout(const NodeProg* prog,
+              const std::unordered_map<std::string, size_t>* globals,
+              size_t global_slots)
+      : m_globals(globals),
+        m_global_slots(global_slots),
+        m_frame_slots(global_slots) {
+    walk(prog);
+  }
+
+  size_t slot_of(const NodeStmtLet* stmt_let) const {
+    return m_slots.at(stmt_let);
+  }
+  size_t slot_of(const NodeTermIdent* term_ident) const {
+    return m_slots.at(term_ident);
+  }
+  size_t slot_of(const NodeStmtReAssign* assign) const {
+    return m_slots.at(assign);
+  }
+
+  // Number of 8-byte slots reserved in the prologue.
+  size_t frame_slots() const { return m_frame_slots; }
+
+  static std::string slot_addr(size_t slot) {
+    return "QWORD [rbp - " + std::to_string((slot + 1) * 8) + "]";
+  }
+};
@@ -2,73 +2,483 @@
 
 #include <assert.h>
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+#include "frame.hpp"
 #include "parser.hpp"
+#include "profile.hpp"
+#include "value_numbering.hpp"
+#include "visitor.hpp"
 
+struct CompileStats {
+  size_t cse_eliminated = 0;
+  size_t cold_arms = 0;
+};
+
+constexpr size_t MAX_JOBS = 256;
+
+struct GeneratorOptions {
+  // Count how often each if/elif/else arm runs and write the counters to this
+  // path when the program exits.
+  std::optional<std::string> profile_generate;
+  // Lay out ladders from the counters of an instrumented run.
+  std::optional<std::string> profile_use;
+  // Worker threads for code generation, at most MAX_JOBS. The output does
+  // not depend on it.
+  size_t jobs = 1;
+  // Prefix of generated labels, so separately generated fragments of one
+  // program do not clash.
+  std::string label_prefix = "label";
+};
+
+// Expressions are compiled by maximal munch: each method evaluates its node
+// into rax, folding leaf operands (32-bit immediates, locals and reused
+// values) straight into the instruction that consumes them and only going
+// through the stack when both sides of an operator are non-trivial.
 class Generator {
  private:
-  struct var {
-    std::string name;
-    size_t stack_loc;
+  struct Operand {
+    std::string text;
+    bool imm;
   };
 
   std::stringstream m_output;
+  std::stringstream m_cold;
   const NodeProg* m_prog;
-  size_t m_stack_size = 0;
-  std::vector<var> m_vars{};
-  std::vector<size_t> m_scopes{};
+  const GeneratorOptions m_options;
+  std::shared_ptr<const FrameLayout> m_frame;
+  std::shared_ptr<const ValueNumbering> m_vn;
+  std::shared_ptr<const ProfileLayout> m_profile_layout;
+  std::shared_ptr<const std::vector<uint64_t>> m_profile;
   int m_label_count = 0;
+  size_t m_cold_arms = 0;
+
+  void push(const std::string& reg) { m_output << "    push " << reg << "\n"; }
 
-  void push(const std::string& reg) {
-    m_output << "    push " << reg << "\n";
-    ++m_stack_size;
+  void pop(const std::string& reg) { m_output << "    pop " << reg << "\n"; }
+
+  std::string temp_addr(size_t temp) const {
+    return FrameLayout::slot_addr(m_frame->frame_slots() + temp);
   }
 
-  void pop(const std::string& reg) {
-    m_output << "    pop " << reg << "\n";
-    --m_stack_size;
+  std::string create_label() {
+    return m_options.label_prefix + std::to_string(m_label_count++);
   }
 
-  void begin_scope() { m_scopes.push_back(m_vars.size()); }
-  void end_scope() {
-    auto pop_count = m_vars.size() - m_scopes.back();
-    m_output << "    add rsp, " << pop_count * 8 << std::endl;
-    m_stack_size -= pop_count;
-    for (int i = 0; i < pop_count; ++i) {
-      m_vars.pop_back();
+  static const NodeExpr* strip_parens(const NodeExpr* expr) {
+    while (auto term = std::get_if<NodeTerm*>(&expr->var)) {
+      auto term_paren = std::get_if<NodeTermParen*>(&(*term)->var);
+      if (!term_paren) {
+        break;
+      }
+      expr = (*term_paren)->expr;
     }
-    m_scopes.pop_back();
+    return expr;
   }
 
-  std::string create_label() {
-    return "label" + std::to_string(m_label_count++);
+  static std::optional<uint64_t> int_lit_of(const NodeExpr* expr) {
+    auto term = std::get_if<NodeTerm*>(&strip_parens(expr)->var);
+    if (!term) {
+      return {};
+    }
+    auto term_int_lit = std::get_if<NodeTermIntLit*>(&(*term)->var);
+    if (!term_int_lit) {
+      return {};
+    }
+    const std::string& text = (*term_int_lit)->int_lit.value.value();
+    uint64_t value;
+    auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(),
+                                     value);
+    if (ec != std::errc()) {
+      return {};
+    }
+    return value;
+  }
+
+  // Binary expression that may be folded into a larger pattern, i.e. one that
+  // value numbering neither spills nor replaces.
+  const NodeBinExpr* foldable(const NodeExpr* expr) const {
+    auto bin_expr = std::get_if<NodeBinExpr*>(&strip_parens(expr)->var);
+    if (!bin_expr || m_vn->reuse_of(*bin_expr) || m_vn->temp_of(*bin_expr)) {
+      return nullptr;
+    }
+    return *bin_expr;
+  }
+
+  std::optional<Operand> operand_of(const NodeExpr* expr) const {
+    expr = strip_parens(expr);
+    if (auto imm = int_lit_of(expr); imm && imm.value() <= INT32_MAX) {
+      return Operand{.text = std::to_string(imm.value()), .imm = true};
+    }
+    if (auto term = std::get_if<NodeTerm*>(&expr->var)) {
+      if (auto term_ident = std::get_if<NodeTermIdent*>(&(*term)->var)) {
+        return Operand{
+            .text = FrameLayout::slot_addr(m_frame->slot_of(*term_ident)),
+            .imm = false};
+      }
+    } else if (auto reuse =
+                   m_vn->reuse_of(std::get<NodeBinExpr*>(expr->var))) {
+      return Operand{.text = temp_addr(m_vn->temp_of(reuse.value()).value()),
+                     .imm = false};
+    }
+    return {};
+  }
+
+  // `expr * scale` with scale 2, 4 or 8, usable as an lea index.
+  std::optional<std::pair<const NodeExpr*, uint64_t>> scaled_index(
+      const NodeExpr* expr) const {
+    auto bin_expr = foldable(expr);
+    if (!bin_expr) {
+      return {};
+    }
+    auto mul = std::get_if<NodeBinExprMul*>(&bin_expr->var);
+    if (!mul) {
+      return {};
+    }
+    for (auto [index, scale] : {std::pair{(*mul)->lhs, (*mul)->rhs},
+                                std::pair{(*mul)->rhs, (*mul)->lhs}}) {
+      auto imm = int_lit_of(scale);
+      if (imm == 2 || imm == 4 || imm == 8) {
+        return std::pair{index, imm.value()};
+      }
+    }
+    return {};
+  }
+
+  // Evaluates `rhs` and then `lhs` (the order value numbering assumes),
+  // leaving lhs in rax and returning the operand holding rhs. Commutative
+  // operators may get the sides swapped when only lhs is a leaf.
+  std::string gen_operands(const NodeExpr* lhs, const NodeExpr* rhs,
+                           bool commutative, bool allow_imm = true) {
+    auto rhs_operand = operand_of(rhs);
+    if (rhs_operand && (allow_imm || !rhs_operand->imm)) {
+      gen_expr(lhs);
+      return rhs_operand->text;
+    }
+    if (rhs_operand) {
+      gen_expr(lhs);
+      m_output << "    mov rcx, " << rhs_operand->text << "\n";
+      return "rcx";
+    }
+
+    gen_expr(rhs);
+    auto lhs_operand = operand_of(lhs);
+    if (lhs_operand && commutative && (allow_imm || !lhs_operand->imm)) {
+      return lhs_operand->text;
+    }
+    if (lhs_operand) {
+      m_output << "    mov rcx, rax\n";
+      m_output << "    mov rax, " << lhs_operand->text << "\n";
+      return "rcx";
+    }
+    push("rax");
+    gen_expr(lhs);
+    pop("rcx");
+    return "rcx";
+  }
+
+  std::string to_rcx(const std::string& operand) {
+    if (operand != "rcx") {
+      m_output << "    mov rcx, " << operand << "\n";
+    }
+    return "rcx";
+  }
+
+  // Stores the value of `expr` into a frame slot.
+  void gen_store(const std::string& addr, const NodeExpr* expr) {
+    if (auto operand = operand_of(expr); operand && operand->imm) {
+      m_output << "    mov " << addr << ", " << operand->text << "\n";
+      return;
+    }
+    gen_expr(expr);
+    m_output << "    mov " << addr << ", rax\n";
+  }
+
+  // Evaluates `expr` as a branch condition and jumps to `label` when its truth
+  // value equals `jump_if`; subtractions become a cmp feeding the jump.
+  void gen_cond(const NodeExpr* expr, const std::string& label, bool jump_if) {
+    if (auto imm = int_lit_of(expr)) {
+      if ((imm.value() != 0) == jump_if) {
+        m_output << "    jmp " << label << "\n";
+      }
+      return;
+    }
+
+    if (auto bin_expr = foldable(expr)) {
+      if (auto sub = std::get_if<NodeBinExprSub*>(&bin_expr->var)) {
+        auto lhs = operand_of((*sub)->lhs);
+        auto rhs = operand_of((*sub)->rhs);
+        if (lhs && !lhs->imm && rhs && rhs->imm) {
+          m_output << "    cmp " << lhs->text << ", " << rhs->text << "\n";
+        } else {
+          const std::string operand =
+              gen_operands((*sub)->lhs, (*sub)->rhs, false);
+          m_output << "    cmp rax, " << operand << "\n";
+        }
+        m_output << "    " << (jump_if ? "jne " : "je ") << label << "\n";
+        return;
+      }
+    }
+
+    if (auto operand = operand_of(expr)) {
+      m_output << "    cmp " << operand->text << ", 0\n";
+    } else {
+      gen_expr(expr);
+      m_output << "    test rax, rax\n";
+    }
+    m_output << "    " << (jump_if ? "jnz " : "jz ") << label << "\n";
+  }
+
+  template <typename Node>
+  void gen_count(const Node* node) {
+    if (m_options.profile_generate.has_value()) {
+      m_output << "    inc QWORD [rel hydro_prof + "
+               << (2 + m_profile_layout->counter_of(node)) * 8 << "]\n";
+    }
+  }
+
+  template <typename Node>
+  uint64_t profile_count(const Node* node) const {
+    return m_profile ? (*m_profile)[m_profile_layout->counter_of(node)] : 0;
+  }
+
+  // Exits with the status in rdi, dumping the profile first when
+  // instrumenting.
+  void gen_exit() {
+    if (m_options.profile_generate.has_value()) {
+      push("rdi");
+      m_output << "    call hydro_prof_dump\n";
+      pop("rdi");
+    }
+    m_output << "    mov rax, 60\n";
+    m_output << "    syscall\n";
+  }
+
+  // Emits one conditional arm of a ladder. `reach` is how often the profile
+  // saw the condition evaluated; an arm taken less often than it was skipped
+  // is moved out of line behind a jump-if-true, so the hot path falls
+  // through to the next condition. Conditions keep their source order.
+  void gen_arm(const NodeExpr* expr, const NodeScope* scope, bool has_next,
+               const std::string& end_label, uint64_t& reach) {
+    const std::string label = create_label();
+    const uint64_t taken = profile_count(scope);
+    const bool cold = m_profile && taken * 2 < reach;
+    reach -= std::min(reach, taken);
+
+    if (cold) {
+      gen_cond(expr, label, true);
+      std::stringstream arm;
+      std::swap(m_output, arm);
+      m_output << label << ":\n";
+      gen_count(scope);
+      gen_scope(scope);
+      m_output << "    jmp " << end_label << "\n";
+      std::swap(m_output, arm);
+      m_cold << arm.str();
+      ++m_cold_arms;
+      return;
+    }
+
+    gen_cond(expr, label, false);
+    gen_count(scope);
+    gen_scope(scope);
+    if (has_next) {
+      m_output << "    jmp " << end_label << "\n";
+    }
+    m_output << label << ":\n";
+  }
+
+  // Writes the counters to the profile file with raw syscalls.
+  void gen_profile_runtime() {
+    m_output << "hydro_prof_dump:\n";
+    m_output << "    mov rax, 2\n";
+    m_output << "    lea rdi, [rel hydro_prof_path]\n";
+    m_output << "    mov rsi, 577\n";  // O_WRONLY | O_CREAT | O_TRUNC
+    m_output << "    mov rdx, 420\n";  // 0644
+    m_output << "    syscall\n";
+    m_output << "    test rax, rax\n";
+    m_output << "    js hydro_prof_done\n";
+    m_output << "    mov rdi, rax\n";
+    m_output << "    mov rax, 1\n";
+    m_output << "    lea rsi, [rel hydro_prof]\n";
+    m_output << "    mov rdx, " << (2 + m_profile_layout->size()) * 8 << "\n";
+    m_output << "    syscall\n";
+    m_output << "    mov rax, 3\n";
+    m_output << "    syscall\n";
+    m_output << "hydro_prof_done:\n";
+    m_output << "    ret\n";
+
+    m_output << "section .data\n";
+    m_output << "hydro_prof_path: db ";
+    for (const char c : m_options.profile_generate.value()) {
+      m_output << static_cast<int>(static_cast<unsigned char>(c)) << ", ";
+    }
+    m_output << "0\n";
+    m_output << "hydro_prof: dq " << PROFILE_MAGIC << ", "
+             << m_profile_layout->size() << "\n";
+    m_output << "    times " << m_profile_layout->size() << " dq 0\n";
+  }
+
+  // Shares the analyses of `parent` but emits into its own buffers, numbering
+  // labels from `label_base`.
+  Generator(const Generator& parent, int label_base)
+      : m_prog(parent.m_prog),
+        m_options(parent.m_options),
+        m_frame(parent.m_frame),
+        m_vn(parent.m_vn),
+        m_profile_layout(parent.m_profile_layout),
+        m_profile(parent.m_profile),
+        m_label_count(label_base) {}
+
+  // Number of labels gen_stmt creates for a statement, so workers can be
+  // handed disjoint label ranges that match a serial run.
+  static size_t count_labels(const NodeStmt* stmt) {
+    if (auto stmt_scope = std::get_if<NodeScope*>(&stmt->var)) {
+      return count_labels(*stmt_scope);
+    }
+    auto stmt_if = std::get_if<NodeStmtIf*>(&stmt->var);
+    if (!stmt_if) {
+      return 0;
+    }
+    size_t count = 2 + count_labels((*stmt_if)->scope);
+    std::optional<NodeIfPred*> pred = (*stmt_if)->pred;
+    while (pred.has_value()) {
+      if (auto _elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+        count += 1 + count_labels((*_elif)->scope);
+        pred = (*_elif)->pred;
+      } else {
+        auto _else = std::get<NodeIfPredElse*>(pred.value()->var);
+        count += count_labels(_else->scope);
+        pred.reset();
+      }
+    }
+    return count;
+  }
+
+  static size_t count_labels(const NodeScope* scope) {
+    size_t count = 0;
+    for (const auto stmt : scope->stmts) {
+      count += count_labels(stmt);
+    }
+    return count;
+  }
+
+  // Flattens bare scopes, which emit no code of their own, so a program that
+  // is one huge block still splits into many independent work items.
+  static void plan_work(const std::vector<NodeStmt*>& stmts,
+                        std::vector<const NodeStmt*>& work) {
+    for (const NodeStmt* stmt : stmts) {
+      if (auto stmt_scope = std::get_if<NodeScope*>(&stmt->var)) {
+        plan_work((*stmt_scope)->stmts, work);
+      } else {
+        work.push_back(stmt);
+      }
+    }
+  }
+
+  // Generates `work` on m_options.jobs threads. Items are grouped into
+  // contiguous chunks, each chunk is emitted by a worker generator whose
+  // label range starts where a serial run would be at that point, and the
+  // buffers are concatenated in order, so the result is byte-identical to
+  // generating the items one after another.
+  void gen_parallel(const std::vector<const NodeStmt*>& work) {
+    struct Chunk {
+      size_t begin;
+      size_t end;
+      int label_base;
+      std::string output{};
+      std::string cold{};
+      size_t cold_arms = 0;
+    };
+
+    const size_t jobs = std::min(m_options.jobs, MAX_JOBS);
+    const size_t chunk_count = std::min(work.size(), jobs * 4);
+    std::vector<Chunk> chunks;
+    int label_base = m_label_count;
+    for (size_t i = 0; i < chunk_count; ++i) {
+      Chunk chunk{.begin = work.size() * i / chunk_count,
+                  .end = work.size() * (i + 1) / chunk_count,
+                  .label_base = label_base};
+      for (size_t j = chunk.begin; j < chunk.end; ++j) {
+        label_base += static_cast<int>(count_labels(work[j]));
+      }
+      chunks.push_back(std::move(chunk));
+    }
+
+    std::atomic<size_t> next = 0;
+    auto worker = [&] {
+      for (size_t i = next++; i < chunks.size(); i = next++) {
+        Chunk& chunk = chunks[i];
+        Generator gen(*this, chunk.label_base);
+        for (size_t j = chunk.begin; j < chunk.end; ++j) {
+          gen.gen_stmt(work[j]);
+        }
+        chunk.output = gen.m_output.str();
+        chunk.cold = gen.m_cold.str();
+        chunk.cold_arms = gen.m_cold_arms;
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(jobs, chunks.size()); ++i) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    for (const Chunk& chunk : chunks) {
+      m_output << chunk.output;
+      m_cold << chunk.cold;
+      m_cold_arms += chunk.cold_arms;
+    }
+    m_label_count = label_base;
   }
 
  public:
-  Generator(const NodeProg* prog) : m_prog(prog) {}
+  Generator(const NodeProg* prog, GeneratorOptions options = {})
+      : Generator(prog, std::make_shared<const FrameLayout>(prog),
+                  std::move(options)) {}
+  // Generates `prog` with a frame laid out by the caller.
+  Generator(const NodeProg* prog, std::shared_ptr<const FrameLayout> frame,
+            GeneratorOptions options = {})
+      : m_prog(prog),
+        m_options(std::move(options)),
+        m_frame(std::move(frame)),
+        m_vn(std::make_shared<const ValueNumbering>(prog, *m_frame)),
+        m_profile_layout(std::make_shared<const ProfileLayout>(prog)) {
+    if (m_options.profile_use.has_value()) {
+      if (auto profile = read_profile(m_options.profile_use.value(),
+                                      m_profile_layout->size())) {
+        m_profile = std::make_shared<const std::vector<uint64_t>>(
+            std::move(profile.value()));
+      }
+    }
+  }
+
+  CompileStats stats() const {
+    return {.cse_eliminated = m_vn->eliminated(), .cold_arms = m_cold_arms};
+  }
 
   void gen_term(const NodeTerm* term) {
     struct TermVisitor {
       Generator& gen;
 
       void operator()(const NodeTermIdent* term_ident) {
-        auto it = std::find_if(
-            gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const var& _var) {
-              return _var.name == term_ident->ident.value.value();
-            });
-        if (it == gen.m_vars.cend()) {
-          std::cerr << "Undeclared identifier: "
-                    << term_ident->ident.value.value() << std::endl;
-          exit(EXIT_FAILURE);
-        }
-        gen.push("QWORD [rsp + " +
-                 std::to_string((gen.m_stack_size - (*it).stack_loc - 1) * 8) +
-                 "]");
+        gen.m_output << "    mov rax, "
+                     << FrameLayout::slot_addr(gen.m_frame->slot_of(term_ident))
+                     << "\n";
       }
 
       void operator()(const NodeTermIntLit* term_int_lit) {
         gen.m_output << "    mov rax, " << term_int_lit->int_lit.value.value()
                      << "\n";
-        gen.push("rax");
       }
 
       void operator()(const NodeTermParen* term_paren) const {
@@ -77,52 +487,99 @@ class Generator {
     };
 
     TermVisitor visitor({.gen = *this});
-    std::visit(visitor, term->var);
+    dispatch(term->var, visitor);
   }
 
   void gen_bin_expr(const NodeBinExpr* bin_expr) {
+    if (auto reuse = m_vn->reuse_of(bin_expr)) {
+      m_output << "    mov rax, "
+               << temp_addr(m_vn->temp_of(reuse.value()).value()) << "\n";
+      return;
+    }
+
     struct BinExprVisitor {
       Generator& gen;
 
       void operator()(const NodeBinExprAdd* add) const {
-        gen.gen_expr(add->rhs);
-        gen.gen_expr(add->lhs);
-        gen.pop("rax");
-        gen.pop("rbx");
-        gen.m_output << "    add rax, rbx\n";
-        gen.push("rax");
+        if (auto scaled = gen.scaled_index(add->rhs)) {
+          const std::string index = gen.to_rcx(
+              gen.gen_operands(add->lhs, scaled->first, false, false));
+          gen.m_output << "    lea rax, [rax + " << index << "*"
+                       << scaled->second << "]\n";
+        } else if (auto scaled = gen.scaled_index(add->lhs)) {
+          const std::string base = gen.to_rcx(
+              gen.gen_operands(scaled->first, add->rhs, false, false));
+          gen.m_output << "    lea rax, [" << base << " + rax*"
+                       << scaled->second << "]\n";
+        } else {
+          const std::string rhs = gen.gen_operands(add->lhs, add->rhs, true);
+          gen.m_output << "    add rax, " << rhs << "\n";
+        }
       }
       void operator()(const NodeBinExprMul* mul) const {
-        gen.gen_expr(mul->rhs);
-        gen.gen_expr(mul->lhs);
-        gen.pop("rax");
-        gen.pop("rbx");
-        gen.m_output << "    mul rbx\n";
-        gen.push("rax");
+        for (auto [expr, factor] : {std::pair{mul->lhs, mul->rhs},
+                                    std::pair{mul->rhs, mul->lhs}}) {
+          auto imm = int_lit_of(factor);
+          if (!imm.has_value() || imm.value() > INT32_MAX) {
+            continue;
+          }
+          gen.gen_expr(expr);
+          if (imm == 3 || imm == 5 || imm == 9) {
+            gen.m_output << "    lea rax, [rax + rax*" << imm.value() - 1
+                         << "]\n";
+          } else if (std::has_single_bit(imm.value())) {
+            if (imm.value() > 1) {
+              gen.m_output << "    shl rax, " << std::countr_zero(imm.value())
+                           << "\n";
+            }
+          } else {
+            gen.m_output << "    imul rax, rax, " << imm.value() << "\n";
+          }
+          return;
+        }
+        const std::string rhs =
+            gen.gen_operands(mul->lhs, mul->rhs, true, false);
+        gen.m_output << "    imul rax, " << rhs << "\n";
       }
       void operator()(const NodeBinExprSub* sub) const {
-        gen.gen_expr(sub->rhs);
-        gen.gen_expr(sub->lhs);
-        gen.pop("rax");
-        gen.pop("rbx");
-        gen.m_output << "    sub rax, rbx\n";
-        gen.push("rax");
+        const std::string rhs = gen.gen_operands(sub->lhs, sub->rhs, false);
+        gen.m_output << "    sub rax, " << rhs << "\n";
       }
       void operator()(const NodeBinExprDiv* div) const {
-        gen.gen_expr(div->rhs);
-        gen.gen_expr(div->lhs);
-        gen.pop("rax");
-        gen.pop("rbx");
-        gen.m_output << "    div rbx\n";
-        gen.push("rax");
+        auto imm = int_lit_of(div->rhs);
+        if (imm.has_value() && std::has_single_bit(imm.value())) {
+          gen.gen_expr(div->lhs);
+          if (imm.value() > 1) {
+            gen.m_output << "    shr rax, " << std::countr_zero(imm.value())
+                         << "\n";
+          }
+          return;
+        }
+        const std::string rhs =
+            gen.gen_operands(div->lhs, div->rhs, false, false);
+        gen.m_output << "    xor edx, edx\n";
+        gen.m_output << "    div " << rhs << "\n";
       }
     };
 
     BinExprVisitor visitor({.gen = *this});
-    std::visit(visitor, bin_expr->var);
+    dispatch(bin_expr->var, visitor);
+
+    if (auto temp = m_vn->temp_of(bin_expr)) {
+      m_output << "    mov " << temp_addr(temp.value()) << ", rax\n";
+    }
   }
 
   void gen_expr(const NodeExpr* expr) {
+    if (auto operand = operand_of(expr)) {
+      if (operand->text == "0") {
+        m_output << "    xor eax, eax\n";
+      } else {
+        m_output << "    mov rax, " << operand->text << "\n";
+      }
+      return;
+    }
+
     struct ExprVisitor {
       Generator& gen;
 
@@ -133,44 +590,38 @@ class Generator {
     };
 
     ExprVisitor visitor({.gen = *this});
-    std::visit(visitor, expr->var);
+    dispatch(expr->var, visitor);
   }
 
   void gen_scope(const NodeScope* scope) {
-    begin_scope();
-
     for (const auto stmt : scope->stmts) {
       gen_stmt(stmt);
     }
-
-    end_scope();
   }
 
-  void gen_if_pred(const NodeIfPred* pred, const std::string& end_label) {
+  void gen_if_pred(const NodeIfPred* pred, const std::string& end_label,
+                   uint64_t& reach) {
     struct PredVisitor {
       Generator& gen;
       const std::string& end_label;
+      uint64_t& reach;
 
       void operator()(const NodeIfPredElif* _elif) const {
-        gen.gen_expr(_elif->expr);
-        gen.pop("rax");
-        const std::string label = gen.create_label();
-        gen.m_output << "    test rax, rax\n";
-        gen.m_output << "    jz " << label << "\n";
-        gen.gen_scope(_elif->scope);
-        gen.m_output << "    jmp " << end_label << "\n";
+        gen.gen_arm(_elif->expr, _elif->scope, _elif->pred.has_value(),
+                    end_label, reach);
         if (_elif->pred.has_value()) {
-          gen.m_output << label << ":\n";
-          gen.gen_if_pred(_elif->pred.value(), end_label);
+          gen.gen_if_pred(_elif->pred.value(), end_label, reach);
         }
       }
       void operator()(const NodeIfPredElse* _else) const {
+        gen.gen_count(_else->scope);
         gen.gen_scope(_else->scope);
       }
     };
 
-    PredVisitor visitor({.gen = *this, .end_label = end_label});
-    std::visit(visitor, pred->var);
+    PredVisitor visitor(
+        {.gen = *this, .end_label = end_label, .reach = reach});
+    dispatch(pred->var, visitor);
   }
 
   void gen_stmt(const NodeStmt* stmt) {
@@ -178,81 +629,95 @@ class Generator {
       Generator& gen;
 
       void operator()(const NodeStmtExit* stmt_exit) const {
-        gen.gen_expr(stmt_exit->expr);
-
-        gen.m_output << "    mov rax, 60\n";
-        gen.pop("rdi");
-        gen.m_output << "    syscall\n";
+        if (auto operand = gen.operand_of(stmt_exit->expr)) {
+          gen.m_output << "    mov rdi, " << operand->text << "\n";
+        } else {
+          gen.gen_expr(stmt_exit->expr);
+          gen.m_output << "    mov rdi, rax\n";
+        }
+        gen.gen_exit();
       }
 
       void operator()(const NodeStmtLet* stmt_let) const {
-        auto it = std::find_if(
-            gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const var& _var) {
-              return _var.name == stmt_let->ident.value.value();
-            });
-        if (it != gen.m_vars.cend()) {
-          std::cerr << "Duplicate identifiers ("
-                    << stmt_let->ident.value.value() << ")" << std::endl;
-          exit(EXIT_FAILURE);
-        }
-        gen.m_vars.push_back({.name = stmt_let->ident.value.value(),
-                              .stack_loc = gen.m_stack_size});
-        gen.gen_expr(stmt_let->expr);
+        gen.gen_store(FrameLayout::slot_addr(gen.m_frame->slot_of(stmt_let)),
+                      stmt_let->expr);
       }
 
       void operator()(const NodeScope* stmt_scope) const {
         gen.gen_scope(stmt_scope);
       }
       void operator()(const NodeStmtIf* stmt_if) const {
-        gen.gen_expr(stmt_if->expr);
-        gen.pop("rax");
-        std::string label = gen.create_label();
-        gen.m_output << "    test rax, rax\n";
-        gen.m_output << "    jz " << label << "\n";
-        gen.gen_scope(stmt_if->scope);
-        std::optional<std::string> end_label;
-        if (stmt_if->pred.has_value()) {
-          end_label = gen.create_label();
-          gen.m_output << "    jmp " << end_label.value() << "\n";
-        }
-        gen.m_output << label << ":\n";
+        const std::string end_label = gen.create_label();
+        gen.gen_count(stmt_if);
+        uint64_t reach = gen.profile_count(stmt_if);
+        gen.gen_arm(stmt_if->expr, stmt_if->scope, stmt_if->pred.has_value(),
+                    end_label, reach);
         if (stmt_if->pred.has_value()) {
-          gen.gen_if_pred(stmt_if->pred.value(), end_label.value());
-          gen.m_output << end_label.value() << ":\n";
+          gen.gen_if_pred(stmt_if->pred.value(), end_label, reach);
         }
+        gen.m_output << end_label << ":\n";
       }
       void operator()(const NodeStmtReAssign* assign) const {
-        auto it = std::find_if(gen.m_vars.begin(), gen.m_vars.end(),
-                               [&](const var& elt) {
-                                 return elt.name == assign->ident.value.value();
-                               });
-        if (it == gen.m_vars.end()) {
-          std::cerr << "Undeclared identifier: " << assign->ident.value.value()
-                    << std::endl;
-          exit(EXIT_FAILURE);
-        }
-        gen.gen_expr(assign->expr);
-        gen.pop("rax");
-        gen.m_output << "    mov [rsp + "
-                     << (gen.m_stack_size - it->stack_loc - 1) * 8
-                     << "], rax\n";
+        gen.gen_store(FrameLayout::slot_addr(gen.m_frame->slot_of(assign)),
+                      assign->expr);
       }
     };
 
     StmtVisitor visitor({.gen = *this});
-    std::visit(visitor, stmt->var);
+    dispatch(stmt->var, visitor);
   }
 
-  std::string gen_prog() {
-    m_output << "global _start\n_start:\n";
+  // Entry point reserving `slots` frame slots.
+  static std::string gen_prologue(size_t slots) {
+    std::string prologue = "global _start\n_start:\n    mov rbp, rsp\n";
+    if (slots) {
+      prologue += "    sub rsp, " + std::to_string(slots * 8) + "\n";
+    }
+    return prologue;
+  }
+
+  // Frame slots the generated code uses, temporaries included.
+  size_t frame_slots() const {
+    return m_frame->frame_slots() + m_vn->temp_slots();
+  }
 
+  // Code of the statements alone, without prologue, exit or out-of-line
+  // arms, for callers that assemble a program from separately generated
+  // fragments. Value numbering does not reuse values across fragments, and
+  // profiles are not supported since their counters belong to one whole
+  // program. A fragment is generated on the calling thread.
+  std::string gen_fragment() {
     for (const NodeStmt* stmt : m_prog->stmts) {
       gen_stmt(stmt);
     }
+    return m_output.str();
+  }
+
+  std::string cold_code() const { return m_cold.str(); }
+
+  void gen_stmts() {
+    if (m_options.jobs > 1) {
+      std::vector<const NodeStmt*> work;
+      plan_work(m_prog->stmts, work);
+      gen_parallel(work);
+    } else {
+      for (const NodeStmt* stmt : m_prog->stmts) {
+        gen_stmt(stmt);
+      }
+    }
+  }
+
+  std::string gen_prog() {
+    m_output << gen_prologue(frame_slots());
+    gen_stmts();
 
-    m_output << "    mov rax, 60\n";
     m_output << "    mov rdi, 0\n";
-    m_output << "    syscall";
+    gen_exit();
+
+    m_output << m_cold.str();
+    if (m_options.profile_generate.has_value()) {
+      gen_profile_runtime();
+    }
 
     return m_output.str();
   }
@@ -0,0 +1,575 @@
+#pragma once
+
+#include <bit>
+#include <memory>
+#include <ostream>
+#include <unordered_map>
+
+#include "generator.hpp"
+#include "visitor.hpp"
+
+// Replaces `removed` bytes at `offset` with `inserted`.
+struct TextEdit {
+  size_t offset;
+  size_t removed;
+  std::string inserted;
+};
+
+struct IncrementalStats {
+  size_t relexed_tokens = 0;
+  size_t reparsed_tokens = 0;
+  size_t regenerated_segments = 0;
+};
+
+// Keeps a program lexed, parsed and generated across edits. The source is
+// split into segments of one top-level statement each. An edit re-lexes the
+// tokens around it until the new stream agrees with the old one again,
+// reparses the innermost scope enclosing the changed tokens (the whole
+// statement when there is none) and regenerates the segments it touched.
+// Later segments are regenerated as well only when the top-level variables
+// a segment declares change, since that moves their frame slots.
+// Each segment is generated as a fragment.
+class IncrementalCompiler {
+ private:
+  struct Segment {
+    uint64_t id;
+    std::string text;
+    size_t newlines = 0;
+    // Positions and lines are relative to the start of the segment.
+    std::vector<Token> tokens{};
+    // Scope opened by each `{` token, nullptr for every other token.
+    std::vector<NodeScope*> scopes{};
+    std::vector<NodeStmt*> stmts{};
+    std::vector<std::shared_ptr<ArenaAllocator>> arenas{};
+    // Arena holding the statements of each scope reparsed on its own. It is
+    // dropped when the scope, or one enclosing it, is reparsed again.
+    std::unordered_map<const NodeScope*, std::unique_ptr<ArenaAllocator>>
+        scope_arenas{};
+    // Names of the top-level variables the segment declares, in order.
+    std::vector<std::string> globals{};
+    size_t global_base = 0;
+    bool dirty = true;
+    std::string code{};
+    std::string cold{};
+    size_t frame_slots = 0;
+  };
+
+  // Drops the arenas of the scopes nested in the statements it walks.
+  class ScopeArenaReleaser : AstWalker<ScopeArenaReleaser> {
+   private:
+    friend AstWalker<ScopeArenaReleaser>;
+
+    Segment& m_seg;
+
+    void post(const NodeScope* scope) { m_seg.scope_arenas.erase(scope); }
+
+   public:
+    explicit ScopeArenaReleaser(Segment& seg) : m_seg(seg) {}
+
+    void release(const std::vector<NodeStmt*>& stmts) {
+      for (const NodeStmt* stmt : stmts) {
+        walk(stmt);
+      }
+    }
+  };
+
+  // Changed tokens [begin, end) of a segment after re-lexing.
+  struct Window {
+    size_t begin;
+    size_t end;
+    bool balanced;
+  };
+
+  // Fenwick tree over the sizes of the segments, so that the start of a
+  // segment and the segment holding an offset are found in O(log n) without
+  // shifting every later segment on each edit.
+  class SizeIndex {
+   private:
+    std::vector<size_t> m_tree{0};
+
+   public:
+    void assign(const std::vector<size_t>& sizes) {
+      m_tree.assign(sizes.size() + 1, 0);
+      for (size_t i = 1; i < m_tree.size(); ++i) {
+        m_tree[i] += sizes[i - 1];
+        if (size_t parent = i + (i & -i); parent < m_tree.size()) {
+          m_tree[parent] += m_tree[i];
+        }
+      }
+    }
+
+    void add(size_t index, size_t delta) {
+      for (size_t i = index + 1; i < m_tree.size(); i += i & -i) {
+        m_tree[i] += delta;
+      }
+    }
+
+    // Total size of the first `count` segments.
+    size_t prefix(size_t count) const {
+      size_t sum = 0;
+      for (size_t i = count; i > 0; i -= i & -i) {
+        sum += m_tree[i];
+      }
+      return sum;
+    }
+
+    // Number of leading segments whose total size is at most `value`.
+    size_t count_within(size_t value) const {
+      size_t count = 0;
+      for (size_t step = std::bit_floor(m_tree.size() - 1); step; step >>= 1) {
+        if (count + step < m_tree.size() && m_tree[count + step] <= value) {
+          count += step;
+          value -= m_tree[count];
+        }
+      }
+      return count;
+    }
+  };
+
+  GeneratorOptions m_options;
+  std::vector<std::unique_ptr<Segment>> m_segments{};
+  SizeIndex m_offsets{};
+  SizeIndex m_lines{};
+  // Slot of every top-level variable by name, the first one for duplicates.
+  std::unordered_map<std::string, size_t> m_globals{};
+  uint64_t m_next_id = 0;
+  bool m_restructured = false;
+  IncrementalStats m_stats{};
+
+  static size_t count_newlines(std::string_view text) {
+    return std::count(text.begin(), text.end(), '\n');
+  }
+
+  static bool same_token(const Token& a, const Token& b) {
+    return a.type == b.type && a.value == b.value;
+  }
+
+  static bool balanced(auto begin, auto end) {
+    int depth = 0;
+    for (auto it = begin; it != end; ++it) {
+      if (it->type == TokenType::_open_braces) {
+        ++depth;
+      } else if (it->type == TokenType::_closed_braces && --depth < 0) {
+        return false;
+      }
+    }
+    return depth == 0;
+  }
+
+  void reindex() {
+    std::vector<size_t> sizes;
+    std::vector<size_t> newlines;
+    for (const auto& seg : m_segments) {
+      sizes.push_back(seg->text.size());
+      newlines.push_back(seg->newlines);
+    }
+    m_offsets.assign(sizes);
+    m_lines.assign(newlines);
+    m_restructured = false;
+  }
+
+  size_t locate(size_t offset) const {
+    return std::min(m_offsets.count_within(offset), m_segments.size() - 1);
+  }
+
+  int line_of(size_t index) const {
+    return 1 + static_cast<int>(m_lines.prefix(index));
+  }
+
+  // Appends segment `index + 1` to segment `index`.
+  void absorb_next(size_t index) {
+    Segment& seg = *m_segments[index];
+    Segment& next = *m_segments[index + 1];
+    for (Token& token : next.tokens) {
+      token.pos += seg.text.size();
+      token.line += static_cast<int>(seg.newlines);
+      seg.tokens.push_back(std::move(token));
+    }
+    seg.scopes.insert(seg.scopes.end(), next.scopes.begin(), next.scopes.end());
+    seg.stmts.insert(seg.stmts.end(), next.stmts.begin(), next.stmts.end());
+    seg.arenas.insert(seg.arenas.end(), next.arenas.begin(), next.arenas.end());
+    seg.scope_arenas.merge(next.scope_arenas);
+    seg.globals.insert(seg.globals.end(), next.globals.begin(),
+                       next.globals.end());
+    seg.text += next.text;
+    seg.newlines += next.newlines;
+    m_segments.erase(m_segments.begin() + index + 1);
+    m_restructured = true;
+  }
+
+  // Applies an edit at `offset` within segment `index` and re-lexes from the
+  // token before it until a new token lines up with an old one at the same
+  // place in the unedited text; the tokens from there on are kept and only
+  // shifted. Lexing past the end of the segment pulls in the next one, since
+  // a token or comment may now run across the boundary.
+  Window relex(size_t index, size_t offset, size_t removed,
+               const std::string& inserted) {
+    Segment& seg = *m_segments[index];
+    const size_t delta = inserted.size() - removed;
+    const size_t edit_end = offset + inserted.size();
+
+    while (true) {
+      std::string text = seg.text;
+      text.replace(offset, removed, inserted);
+
+      const std::vector<Token>& old = seg.tokens;
+      size_t begin = std::lower_bound(old.begin(), old.end(), offset,
+                                      [](const Token& token, size_t pos) {
+                                        return token.pos < pos;
+                                      }) -
+                     old.begin();
+      Tokenizer tokenizer = begin == 0 ? Tokenizer(text, 0, 0)
+                                       : Tokenizer(text, old[begin - 1].pos,
+                                                   old[begin - 1].line);
+      begin -= begin > 0;
+
+      std::vector<Token> fresh;
+      std::optional<size_t> resync;
+      int line_delta = 0;
+      size_t j = begin;
+      while (auto token = tokenizer.next()) {
+        if (token->pos >= edit_end) {
+          const size_t old_pos = token->pos - delta;
+          while (j < old.size() && old[j].pos < old_pos) {
+            ++j;
+          }
+          if (j < old.size() && old[j].pos == old_pos &&
+              same_token(old[j], token.value())) {
+            resync = j;
+            line_delta = token->line - old[j].line;
+            break;
+          }
+        }
+        fresh.push_back(std::move(token.value()));
+      }
+      if (!resync.has_value() && index + 1 < m_segments.size()) {
+        absorb_next(index);
+        continue;
+      }
+
+      // The token lexed before the edit usually comes back unchanged.
+      size_t old_end = resync.value_or(old.size());
+      size_t kept = 0;
+      while (kept < fresh.size() && begin + kept < old_end &&
+             same_token(fresh[kept], old[begin + kept]) &&
+             fresh[kept].pos == old[begin + kept].pos) {
+        ++kept;
+      }
+      begin += kept;
+      fresh.erase(fresh.begin(), fresh.begin() + kept);
+
+      const bool window_balanced =
+          balanced(old.begin() + begin, old.begin() + old_end) &&
+          balanced(fresh.begin(), fresh.end());
+      m_stats.relexed_tokens += fresh.size() + kept;
+
+      std::vector<Token> tokens(old.begin(), old.begin() + begin);
+      std::vector<NodeScope*> scopes(seg.scopes.begin(),
+                                     seg.scopes.begin() + begin);
+      const size_t end = begin + fresh.size();
+      tokens.insert(tokens.end(), std::make_move_iterator(fresh.begin()),
+                    std::make_move_iterator(fresh.end()));
+      scopes.resize(end, nullptr);
+      for (size_t i = old_end; i < old.size(); ++i) {
+        tokens.push_back(old[i]);
+        tokens.back().pos += delta;
+        tokens.back().line += line_delta;
+        scopes.push_back(seg.scopes[i]);
+      }
+
+      seg.tokens = std::move(tokens);
+      seg.scopes = std::move(scopes);
+      seg.text = std::move(text);
+      seg.newlines = count_newlines(seg.text);
+      return {.begin = begin, .end = end, .balanced = window_balanced};
+    }
+  }
+
+  // Opening and closing brace of the innermost scope around [begin, end).
+  static std::optional<std::pair<size_t, size_t>> enclosing_scope(
+      const std::vector<Token>& tokens, size_t begin, size_t end) {
+    int depth = 0;
+    size_t open = begin;
+    while (true) {
+      if (open == 0) {
+        return {};
+      }
+      --open;
+      if (tokens[open].type == TokenType::_closed_braces) {
+        ++depth;
+      } else if (tokens[open].type == TokenType::_open_braces &&
+                 depth-- == 0) {
+        break;
+      }
+    }
+    depth = 0;
+    for (size_t close = open + 1; close < tokens.size(); ++close) {
+      if (tokens[close].type == TokenType::_open_braces) {
+        ++depth;
+      } else if (tokens[close].type == TokenType::_closed_braces &&
+                 depth-- == 0) {
+        if (close < end) {
+          return {};
+        }
+        return std::pair{open, close};
+      }
+    }
+    return {};
+  }
+
+  // Reparses the scope opening at token `open` and swaps the new statements
+  // into the existing node, so the statements around it are reused. The new
+  // statements get an arena of their own, and the one holding the statements
+  // they replace is freed.
+  void reparse_scope(size_t index, size_t open, size_t close) {
+    Segment& seg = *m_segments[index];
+    std::vector<Token> tokens(seg.tokens.begin() + open,
+                              seg.tokens.begin() + close + 1);
+    m_stats.reparsed_tokens += tokens.size();
+    auto arena = std::make_unique<ArenaAllocator>(
+        std::max<size_t>(1024, tokens.size() * 64));
+    Parser parser(std::move(tokens), *arena, line_of(index));
+    parser.parse_scope();
+    NodeScope* target = seg.scopes[open];
+    ScopeArenaReleaser(seg).release(target->stmts);
+    for (auto [brace, scope] : parser.scopes()) {
+      if (brace == 0) {
+        target->stmts = std::move(scope->stmts);
+      } else {
+        seg.scopes[open + brace] = scope;
+      }
+    }
+    seg.scope_arenas[target] = std::move(arena);
+    seg.dirty = true;
+  }
+
+  // Reparses segment `index` from scratch and splits it into one segment per
+  // statement. Returns the range of segments that need to be regenerated.
+  std::pair<size_t, size_t> reparse_segment(size_t index) {
+    // An elif or else continues the ladder of the previous statement.
+    while (index > 0 && !m_segments[index]->tokens.empty() &&
+           (m_segments[index]->tokens.front().type == TokenType::_elif ||
+            m_segments[index]->tokens.front().type == TokenType::_else)) {
+      absorb_next(--index);
+    }
+
+    Segment& seg = *m_segments[index];
+    const std::vector<std::string> old_globals = std::move(seg.globals);
+    m_stats.reparsed_tokens += seg.tokens.size();
+    auto arena = std::make_shared<ArenaAllocator>(
+        std::max<size_t>(4096, seg.tokens.size() * 64));
+    Parser parser(seg.tokens, *arena, line_of(index));
+    std::vector<size_t> starts;
+    std::vector<NodeStmt*> stmts;
+    while (parser.token_index() < seg.tokens.size()) {
+      starts.push_back(parser.token_index());
+      if (auto stmt = parser.parse_stmt()) {
+        stmts.push_back(stmt.value());
+      } else {
+        parser.error_expected("statement");
+      }
+    }
+
+    if (stmts.empty() && m_segments.size() > 1) {
+      // Only whitespace and comments are left; hand them to a neighbour.
+      if (index > 0) {
+        Segment& prev = *m_segments[index - 1];
+        prev.text += seg.text;
+        prev.newlines += seg.newlines;
+      } else {
+        Segment& next = *m_segments[index + 1];
+        for (Token& token : next.tokens) {
+          token.pos += seg.text.size();
+          token.line += static_cast<int>(seg.newlines);
+        }
+        next.text = seg.text + next.text;
+        next.newlines += seg.newlines;
+      }
+      m_segments.erase(m_segments.begin() + index);
+      m_restructured = true;
+      return update_globals(index, index, old_globals);
+    }
+
+    std::vector<NodeScope*> scopes(seg.tokens.size(), nullptr);
+    for (auto [brace, scope] : parser.scopes()) {
+      scopes[brace] = scope;
+    }
+
+    std::vector<std::unique_ptr<Segment>> parts;
+    for (size_t i = 0; i < std::max<size_t>(stmts.size(), 1); ++i) {
+      const size_t first = i == 0 ? 0 : starts[i];
+      const size_t last =
+          i + 1 < starts.size() ? starts[i + 1] : seg.tokens.size();
+      const size_t text_begin = i == 0 ? 0 : seg.tokens[first].pos;
+      const size_t text_end =
+          last < seg.tokens.size() ? seg.tokens[last].pos : seg.text.size();
+      const int line_base = i == 0 ? 0 : seg.tokens[first].line;
+
+      auto part = std::make_unique<Segment>(Segment{
+          .id = i == 0 ? seg.id : m_next_id++,
+          .text = seg.text.substr(text_begin, text_end - text_begin)});
+      part->newlines = count_newlines(part->text);
+      for (size_t t = first; t < last; ++t) {
+        part->tokens.push_back(seg.tokens[t]);
+        part->tokens.back().pos -= text_begin;
+        part->tokens.back().line -= line_base;
+        part->scopes.push_back(scopes[t]);
+      }
+      if (i < stmts.size()) {
+        part->stmts.push_back(stmts[i]);
+        if (auto stmt_let = std::get_if<NodeStmtLet*>(&stmts[i]->var)) {
+          part->globals.push_back((*stmt_let)->ident.value.value());
+        }
+      }
+      part->arenas.push_back(arena);
+      parts.push_back(std::move(part));
+    }
+
+    const size_t count = parts.size();
+    m_segments[index] = std::move(parts.front());
+    m_segments.insert(m_segments.begin() + index + 1,
+                      std::make_move_iterator(parts.begin() + 1),
+                      std::make_move_iterator(parts.end()));
+    m_restructured |= count != 1;
+    return update_globals(index, index + count, old_globals);
+  }
+
+  // Numbers the top-level variables of segments [begin, end), which replaced
+  // segments that declared `old_globals`. Returns the segments to regenerate,
+  // which are all later ones too when the variables changed.
+  std::pair<size_t, size_t> update_globals(
+      size_t begin, size_t end, const std::vector<std::string>& old_globals) {
+    std::vector<std::string> new_globals;
+    for (size_t i = begin; i < end; ++i) {
+      new_globals.insert(new_globals.end(), m_segments[i]->globals.begin(),
+                         m_segments[i]->globals.end());
+    }
+    if (new_globals != old_globals) {
+      relayout_globals(begin);
+      return {begin, m_segments.size()};
+    }
+    size_t base = begin > 0 ? m_segments[begin - 1]->global_base +
+                                  m_segments[begin - 1]->globals.size()
+                            : 0;
+    for (size_t i = begin; i < end; ++i) {
+      m_segments[i]->global_base = base;
+      base += m_segments[i]->globals.size();
+    }
+    return {begin, end};
+  }
+
+  // Renumbers the top-level variables of every segment from `index` on and
+  // marks those segments for regeneration.
+  void relayout_globals(size_t index) {
+    size_t base = 0;
+    m_globals.clear();
+    for (size_t i = 0; i < m_segments.size(); ++i) {
+      Segment& seg = *m_segments[i];
+      seg.global_base = base;
+      for (const std::string& name : seg.globals) {
+        m_globals.try_emplace(name, base++);
+      }
+      seg.dirty |= i >= index;
+    }
+  }
+
+  void generate(Segment& seg) {
+    NodeProg prog{.stmts = seg.stmts};
+    GeneratorOptions options = m_options;
+    options.label_prefix = "s" + std::to_string(seg.id) + "_";
+    Generator generator(
+        &prog,
+        std::make_shared<const FrameLayout>(&prog, &m_globals,
+                                            seg.global_base),
+        std::move(options));
+    seg.code = generator.gen_fragment();
+    seg.cold = generator.cold_code();
+    seg.frame_slots = generator.frame_slots();
+    seg.dirty = false;
+    ++m_stats.regenerated_segments;
+  }
+
+  void generate_dirty(size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      if (m_segments[i]->dirty) {
+        generate(*m_segments[i]);
+      }
+    }
+  }
+
+ public:
+  explicit IncrementalCompiler(std::string source,
+                               GeneratorOptions options = {})
+      : m_options(std::move(options)) {
+    auto seg = std::make_unique<Segment>(
+        Segment{.id = m_next_id++, .text = std::move(source)});
+    seg->newlines = count_newlines(seg->text);
+    seg->tokens = Tokenizer(seg->text, 0, 0).tokenize();
+    seg->scopes.resize(seg->tokens.size(), nullptr);
+    m_segments.push_back(std::move(seg));
+    reindex();
+
+    reparse_segment(0);
+    reindex();
+    generate_dirty(0, m_segments.size());
+  }
+
+  // Throws CompileError when the edited text does not compile. The compiler
+  // is left part way through the edit and has to be built again from source.
+  IncrementalStats apply(const TextEdit& edit) {
+    m_stats = {};
+    size_t index = locate(edit.offset);
+    const size_t last =
+        edit.removed > 0 ? locate(edit.offset + edit.removed - 1) : index;
+    for (size_t i = index; i < last; ++i) {
+      absorb_next(index);
+    }
+    const size_t start = m_offsets.prefix(index);
+    const size_t old_size = m_segments[index]->text.size();
+    const size_t old_newlines = m_segments[index]->newlines;
+
+    const Window window =
+        relex(index, edit.offset - start, edit.removed, edit.inserted);
+
+    std::optional<std::pair<size_t, size_t>> scope;
+    if (window.balanced) {
+      scope = enclosing_scope(m_segments[index]->tokens, window.begin,
+                              window.end);
+    }
+    if (scope.has_value()) {
+      reparse_scope(index, scope->first, scope->second);
+      generate_dirty(index, index + 1);
+    } else {
+      auto [begin, end] = reparse_segment(index);
+      generate_dirty(begin, end);
+    }
+
+    if (m_restructured) {
+      reindex();
+    } else {
+      m_offsets.add(index, m_segments[index]->text.size() - old_size);
+      m_lines.add(index, m_segments[index]->newlines - old_newlines);
+    }
+    return m_stats;
+  }
+
+  // Writes the program's assembly. Unlike apply() this copies every
+  // segment's code, so it takes time linear in the size of the output.
+  void write_assembly(std::ostream& output) const {
+    size_t slots = 0;
+    for (const auto& seg : m_segments) {
+      slots = std::max(slots, seg->frame_slots);
+    }
+    output << Generator::gen_prologue(slots);
+    for (const auto& seg : m_segments) {
+      output << seg->code;
+    }
+    output << "    mov rdi, 0\n    mov rax, 60\n    syscall\n";
+    for (const auto& seg : m_segments) {
+      output << seg->cold;
+    }
+  }
+
+  // Number of segments, about one per top-level statement.
+  size_t segments() const { return m_segments.size(); }
+};
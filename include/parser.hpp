@@ -1,8 +1,10 @@
 #pragma once
 
+#include <cassert>
 #include <variant>
 
 #include "allocator.hpp"
+#include "token_queue.hpp"
 #include "tokenizer.hpp"
 
 struct NodeTermIntLit {
@@ -107,12 +109,36 @@ struct NodeProg {
 
 class Parser {
  private:
-  std::optional<Token> peek(int offset = 0) const {
-    if (m_index + offset >= m_tokens.size()) {
-      return {};
-    } else {
-      return m_tokens.at(m_index + offset);
+  std::optional<Token> peek(int offset = 0) {
+    while (m_index + offset >= m_tokens.size()) {
+      if (!fill()) {
+        return {};
+      }
     }
+    return m_tokens.at(m_index + offset);
+  }
+
+  // Appends the next batch from a pipelined lexer, first dropping consumed
+  // tokens once they make up most of the buffer. The last consumed token is
+  // kept for error_expected. Returns false at the end of the input or for
+  // tokens given up front.
+  bool fill() {
+    if (m_queue == nullptr) {
+      return false;
+    }
+    std::vector<Token> batch = m_queue->pop();
+    if (batch.empty()) {
+      m_queue = nullptr;
+      return false;
+    }
+    if (m_index > 1 && m_index > m_tokens.size() / 2) {
+      m_tokens.erase(m_tokens.begin(), m_tokens.begin() + (m_index - 1));
+      m_base += m_index - 1;
+      m_index = 1;
+    }
+    m_tokens.insert(m_tokens.end(), std::make_move_iterator(batch.begin()),
+                    std::make_move_iterator(batch.end()));
+    return true;
   }
 
   Token consume() { return m_tokens.at(m_index++); }
@@ -134,18 +160,47 @@ class Parser {
     }
   }
 
-  const std::vector<Token> m_tokens;
+  std::vector<Token> m_tokens;
+  TokenQueue* m_queue = nullptr;
+  // Tokens dropped from the front of m_tokens.
+  size_t m_base = 0;
   size_t m_index = 0;
-  ArenaAllocator m_allocator;
+  std::unique_ptr<ArenaAllocator> m_owned_allocator;
+  ArenaAllocator& m_allocator;
+  const int m_line_base = 0;
+  std::vector<std::pair<size_t, NodeScope*>> m_scopes{};
 
  public:
   explicit Parser(std::vector<Token> tokens)
-      : m_tokens(std::move(tokens)), m_allocator(1024 * 1024 * 4) {}
+      : m_tokens(std::move(tokens)),
+        m_owned_allocator(std::make_unique<ArenaAllocator>(1024 * 1024 * 4)),
+        m_allocator(*m_owned_allocator) {}
+  // Takes tokens from a lexer running on another thread as parsing reaches
+  // them.
+  explicit Parser(TokenQueue& queue)
+      : m_queue(&queue),
+        m_owned_allocator(std::make_unique<ArenaAllocator>(1024 * 1024 * 4)),
+        m_allocator(*m_owned_allocator) {}
+  // Allocates the tree in `allocator`, which must outlive it. Token lines are
+  // reported relative to `line_base`.
+  Parser(std::vector<Token> tokens, ArenaAllocator& allocator,
+         int line_base = 0)
+      : m_tokens(std::move(tokens)),
+        m_allocator(allocator),
+        m_line_base(line_base) {}
+
+  // Index of the next token to be consumed.
+  size_t token_index() const { return m_base + m_index; }
+
+  // Every scope parsed so far with the index of its opening brace.
+  const std::vector<std::pair<size_t, NodeScope*>>& scopes() const {
+    return m_scopes;
+  }
 
-  void error_expected(const std::string& msg) {
-    int line = peek(-1).value().line;
-    std::cerr << "[" << line << "]" << "[PARSER] Expected " << msg << std::endl;
-    exit(EXIT_FAILURE);
+  [[noreturn]] void error_expected(const std::string& msg) {
+    int line = m_line_base + (m_index > 0 ? peek(-1) : peek()).value().line;
+    throw CompileError("[" + std::to_string(line) + "][PARSER] Expected " +
+                       msg);
   }
 
   std::optional<NodeIfPred*> parse_if_pred() {
@@ -276,10 +331,12 @@ class Parser {
   }
 
   std::optional<NodeScope*> parse_scope() {
+    const size_t open_brace = token_index();
     if (!try_consume(TokenType::_open_braces).has_value()) {
       return {};
     }
     auto scope = m_allocator.alloc<NodeScope>();
+    m_scopes.emplace_back(open_brace, scope);
     while (auto stmt = parse_stmt()) {
       scope->stmts.push_back(stmt.value());
     }
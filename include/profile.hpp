@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <unordered_map>
+
+#include "parser.hpp"
+#include "visitor.hpp"
+
+// Numbers the branch counters of every if/elif/else ladder in program order,
+// so an instrumented build and the build that consumes its profile agree on
+// what each counter means. A ladder gets one counter for how often it is
+// entered followed by one per arm, the else arm included.
+class ProfileLayout : AstWalker<ProfileLayout> {
+ private:
+  friend AstWalker<ProfileLayout>;
+
+  std::unordered_map<const void*, size_t> m_counters{};
+  size_t m_size = 0;
+
+  // Counters only depend on statements.
+  bool pre(const NodeExpr*) { return false; }
+  void pre(const NodeStmtIf* stmt_if) {
+    m_counters[stmt_if] = m_size++;
+    m_counters[stmt_if->scope] = m_size++;
+  }
+  void pre(const NodeIfPredElif* _elif) {
+    m_counters[_elif->scope] = m_size++;
+  }
+  void pre(const NodeIfPredElse* _else) {
+    m_counters[_else->scope] = m_size++;
+  }
+
+ public:
+  explicit ProfileLayout(const NodeProg* prog) { walk(prog); }
+
+  // Counter of how often a ladder is entered.
+  size_t counter_of(const NodeStmtIf* stmt_if) const {
+    return m_counters.at(stmt_if);
+  }
+  // Counter of how often an arm is taken, keyed by the arm's scope.
+  size_t counter_of(const NodeScope* arm) const { return m_counters.at(arm); }
+
+  size_t size() const { return m_size; }
+};
+
+// Instrumented binaries dump their counters on exit as raw little-endian
+// 64-bit words: the magic, the number of counters, then the counters.
+constexpr uint64_t PROFILE_MAGIC = 0x3146504f52445948;  // "HYDROPF1"
+
+std::optional<std::vector<uint64_t>> read_profile(const std::string& path,
+                                                  size_t expected) {
+  std::ifstream input(path, std::ios::in | std::ios::binary);
+  uint64_t header[2];
+  if (!input.read(reinterpret_cast<char*>(header), sizeof(header)) ||
+      header[0] != PROFILE_MAGIC) {
+    std::cerr << "[PROFILE] Could not read profile " << path << std::endl;
+    return {};
+  }
+  if (header[1] != expected) {
+    std::cerr << "[PROFILE] Profile " << path << " has " << header[1]
+              << " counters, program needs " << expected << "; ignoring it"
+              << std::endl;
+    return {};
+  }
+  std::vector<uint64_t> counters(expected);
+  if (!input.read(reinterpret_cast<char*>(counters.data()),
+                  expected * sizeof(uint64_t))) {
+    std::cerr << "[PROFILE] Profile " << path << " is truncated" << std::endl;
+    return {};
+  }
+  return counters;
+}
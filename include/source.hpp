@@ -0,0 +1,13 @@
+#pragma once
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+// Contents of the file at `path`, empty when it cannot be read.
+inline std::string read_file(const std::string& path) {
+  std::fstream input(path, std::ios::in);
+  std::stringstream buffer;
+  buffer << input.rdbuf();
+  return buffer.str();
+}
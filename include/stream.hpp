@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <unordered_map>
+#include <utility>
+
+#include "generator.hpp"
+
+// Compiles a program one top-level statement at a time: each statement is
+// lexed from the input, parsed, generated and written out before the next
+// one is read, and its nodes are rewound out of the arena afterwards. Memory
+// is bounded by the largest statement plus the names of the top-level
+// variables, which later statements may refer to.
+//
+// Each statement is generated as a fragment. The frame size is only known at
+// the end and is emitted as a constant the prologue refers to.
+class StreamCompiler {
+ private:
+  Tokenizer m_tokenizer;
+  std::optional<Token> m_lookahead{};
+  ArenaAllocator m_allocator{64 * 1024};
+  GeneratorOptions m_options;
+  std::unordered_map<std::string, size_t> m_globals{};
+  size_t m_global_slots = 0;
+  size_t m_frame_slots = 0;
+  size_t m_statements = 0;
+  CompileStats m_stats{};
+
+  std::optional<Token> take() {
+    if (m_lookahead.has_value()) {
+      return std::exchange(m_lookahead, std::nullopt);
+    }
+    return m_tokenizer.next();
+  }
+
+  // Tokens of the next top-level statement: up to a `;` or closing brace
+  // outside any scope, with the elif and else arms following an if.
+  std::vector<Token> next_statement() {
+    std::vector<Token> tokens;
+    int depth = 0;
+    while (auto token = take()) {
+      const TokenType type = token->type;
+      tokens.push_back(std::move(token.value()));
+      if (type == TokenType::_open_braces) {
+        ++depth;
+      } else if (type == TokenType::_closed_braces) {
+        --depth;
+      }
+      if (depth > 0) {
+        continue;
+      }
+      if (type == TokenType::_semi) {
+        break;
+      }
+      if (type == TokenType::_closed_braces) {
+        m_lookahead = m_tokenizer.next();
+        if (!m_lookahead.has_value() ||
+            (m_lookahead->type != TokenType::_elif &&
+             m_lookahead->type != TokenType::_else)) {
+          break;
+        }
+      }
+    }
+    return tokens;
+  }
+
+  void compile_statement(std::vector<Token> tokens, std::ostream& output) {
+    const ArenaAllocator::Mark mark = m_allocator.mark();
+    {
+      Parser parser(std::move(tokens), m_allocator);
+      const NodeProg* prog = parser.parse_prog().value();
+
+      GeneratorOptions options = m_options;
+      options.label_prefix = "s" + std::to_string(m_statements) + "_";
+      Generator generator(
+          prog,
+          std::make_shared<const FrameLayout>(prog, &m_globals,
+                                              m_global_slots),
+          std::move(options));
+      output << generator.gen_fragment();
+      m_frame_slots = std::max(m_frame_slots, generator.frame_slots());
+      m_stats.cse_eliminated += generator.stats().cse_eliminated;
+
+      for (const NodeStmt* stmt : prog->stmts) {
+        if (auto stmt_let = std::get_if<NodeStmtLet*>(&stmt->var)) {
+          m_globals.try_emplace((*stmt_let)->ident.value.value(),
+                                m_global_slots++);
+        }
+      }
+    }
+    m_allocator.rewind(mark);
+    ++m_statements;
+  }
+
+ public:
+  explicit StreamCompiler(std::istream& input, GeneratorOptions options = {})
+      : m_tokenizer(input), m_options(std::move(options)) {}
+
+  void compile(std::ostream& output) {
+    output << "global _start\n_start:\n    mov rbp, rsp\n"
+           << "    sub rsp, frame_size\n";
+    while (true) {
+      std::vector<Token> tokens = next_statement();
+      if (tokens.empty()) {
+        break;
+      }
+      compile_statement(std::move(tokens), output);
+    }
+    output << "    mov rdi, 0\n    mov rax, 60\n    syscall\n";
+    output << "frame_size equ " << m_frame_slots * 8 << "\n";
+  }
+
+  size_t statements() const { return m_statements; }
+
+  CompileStats stats() const { return m_stats; }
+
+  // Bytes the arena grew to, which bounds the largest statement's tree.
+  size_t arena_bytes() const { return m_allocator.reserved(); }
+};
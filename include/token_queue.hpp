@@ -0,0 +1,125 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <vector>
+
+#include "tokenizer.hpp"
+
+// Hands batches of tokens from a lexer thread to the parser. A lock-free
+// single-producer, single-consumer ring: only the producer advances m_tail
+// and only the consumer advances m_head, each publishing its slot with a
+// release store. When the ring is full the lexer waits for the parser, which
+// bounds how far it runs ahead. A lexing error travels with the end of the
+// input and is rethrown to the parser.
+class TokenQueue {
+ public:
+  static constexpr size_t batch_size = 4096;
+  static constexpr size_t capacity = 16;
+
+  // Blocks while the ring is full. Returns false once the parser has
+  // cancelled, so the lexer can stop.
+  bool push(std::vector<Token> batch) {
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    wait_while(m_head, tail - capacity);
+    if (m_cancelled.load(std::memory_order_acquire)) {
+      return false;
+    }
+    m_slots[tail % capacity] = std::move(batch);
+    m_tail.store(tail + 1, std::memory_order_release);
+    m_tail.notify_one();
+    return true;
+  }
+
+  // Ends the input, with the error that stopped the lexer if any.
+  void finish(std::exception_ptr error = nullptr) {
+    m_error = std::move(error);
+    push({});
+  }
+
+  // Blocks until a batch arrives. An empty batch marks the end of the input.
+  std::vector<Token> pop() {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    wait_while(m_tail, head);
+    std::vector<Token> batch = std::move(m_slots[head % capacity]);
+    m_head.store(head + 1, std::memory_order_release);
+    m_head.notify_one();
+    if (batch.empty() && m_error) {
+      std::rethrow_exception(m_error);
+    }
+    return batch;
+  }
+
+  // Called when the parser stops early. Every later push fails, and a lexer
+  // waiting for room is woken; the head is moved only to wake it, since
+  // nothing is popped afterwards.
+  void cancel() {
+    m_cancelled.store(true, std::memory_order_release);
+    m_head.fetch_add(1, std::memory_order_release);
+    m_head.notify_one();
+  }
+
+ private:
+  // Spins briefly before sleeping until `index` moves past `value`.
+  static void wait_while(const std::atomic<size_t>& index, size_t value) {
+    for (int spin = 0; spin < 64; ++spin) {
+      if (index.load(std::memory_order_acquire) != value) {
+        return;
+      }
+    }
+    while (index.load(std::memory_order_acquire) == value) {
+      index.wait(value, std::memory_order_acquire);
+    }
+  }
+
+  std::array<std::vector<Token>, capacity> m_slots{};
+  // Written by the lexer before the end of the input is published.
+  std::exception_ptr m_error{};
+  std::atomic<bool> m_cancelled{false};
+  alignas(64) std::atomic<size_t> m_head{0};
+  alignas(64) std::atomic<size_t> m_tail{0};
+};
+
+// Lexes the whole source on its own thread, publishing tokens to `queue` in
+// batches and an empty batch at the end. Destroying the producer cancels the
+// queue first, so a parser that stopped early does not wait for the lexer.
+class TokenProducer {
+ private:
+  TokenQueue& m_queue;
+  std::thread m_thread;
+
+ public:
+  TokenProducer(Tokenizer tokenizer, TokenQueue& queue)
+      : m_queue(queue),
+        m_thread([tokenizer = std::move(tokenizer), &queue]() mutable {
+          try {
+            std::vector<Token> batch;
+            batch.reserve(TokenQueue::batch_size);
+            while (auto token = tokenizer.next()) {
+              batch.push_back(std::move(token.value()));
+              if (batch.size() == TokenQueue::batch_size) {
+                if (!queue.push(std::move(batch))) {
+                  return;
+                }
+                batch = {};
+                batch.reserve(TokenQueue::batch_size);
+              }
+            }
+            if (!batch.empty() && !queue.push(std::move(batch))) {
+              return;
+            }
+            queue.finish();
+          } catch (...) {
+            queue.finish(std::current_exception());
+          }
+        }) {}
+  TokenProducer(const TokenProducer&) = delete;
+  TokenProducer& operator=(const TokenProducer&) = delete;
+
+  ~TokenProducer() {
+    m_queue.cancel();
+    m_thread.join();
+  }
+};
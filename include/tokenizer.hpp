@@ -1,6 +1,14 @@
 #pragma once
 
-enum TokenType {
+#include <cctype>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "error.hpp"
+
+enum class TokenType {
   _if,
   _elif,
   _else,
@@ -22,39 +30,39 @@ enum TokenType {
 
 std::string token_to_string(const TokenType& type) {
   switch (type) {
-    case _if:
+    case TokenType::_if:
       return "if";
-    case _elif:
+    case TokenType::_elif:
       return "elif";
-    case _else:
+    case TokenType::_else:
       return "else";
-    case _exit:
+    case TokenType::_exit:
       return "exit";
-    case _int_lit:
+    case TokenType::_int_lit:
       return "int literal";
-    case _semi:
+    case TokenType::_semi:
       return ";";
-    case _open_paren:
+    case TokenType::_open_paren:
       return "(";
-    case _close_paren:
+    case TokenType::_close_paren:
       return ")";
-    case _open_braces:
+    case TokenType::_open_braces:
       return "{";
-    case _closed_braces:
+    case TokenType::_closed_braces:
       return "}";
-    case _ident:
+    case TokenType::_ident:
       return "identifier";
-    case _let:
+    case TokenType::_let:
       return "let";
-    case _op_eq:
+    case TokenType::_op_eq:
       return "=";
-    case _op_add:
+    case TokenType::_op_add:
       return "+";
-    case _op_mul:
+    case TokenType::_op_mul:
       return "*";
-    case _op_sub:
+    case TokenType::_op_sub:
       return "-";
-    case _op_div:
+    case TokenType::_op_div:
       return "/";
     default:
       return "";
@@ -78,67 +86,103 @@ struct Token {
   TokenType type;
   int line;
   std::optional<std::string> value;
+  // Byte offset of the token in the source it was lexed from.
+  size_t pos = 0;
 };
 
 class Tokenizer {
  private:
-  std::optional<char> peek(int offset = 0) const {
-    if (m_index + offset >= m_src.size()) {
-      return {};
-    } else {
-      return m_src.at(m_index + offset);
+  // Bytes read from a stream at a time.
+  static constexpr size_t chunk_size = 64 * 1024;
+
+  std::optional<char> peek(int offset = 0) {
+    while (m_index + offset >= m_src.size()) {
+      if (!fill()) {
+        return {};
+      }
     }
+    return m_src[m_index + offset];
   }
 
   char consume() { return m_src.at(m_index++); }
 
-  const std::string m_src;
+  // Appends the next chunk of a streamed source, first dropping the consumed
+  // prefix once it makes up most of the buffer. Returns false at the end of
+  // the stream or for a source given as a string.
+  bool fill() {
+    if (m_input == nullptr) {
+      return false;
+    }
+    if (m_index > m_src.size() / 2) {
+      m_src.erase(0, m_index);
+      m_base += m_index;
+      m_index = 0;
+    }
+    const size_t size = m_src.size();
+    m_src.resize(size + chunk_size);
+    m_input->read(m_src.data() + size, chunk_size);
+    m_src.resize(size + m_input->gcount());
+    return m_src.size() > size;
+  }
+
+  size_t position() const { return m_base + m_index; }
+
+  Token make(TokenType type, size_t start,
+             std::optional<std::string> value = {}) const {
+    return {.type = type, .line = m_line, .value = std::move(value),
+            .pos = start};
+  }
+
+  std::string m_src;
+  std::istream* m_input = nullptr;
+  // Bytes dropped from the front of m_src.
+  size_t m_base = 0;
   size_t m_index = 0;
+  int m_line = 1;
 
  public:
   explicit Tokenizer(std::string source) : m_src(std::move(source)) {}
-  std::vector<Token> tokenize() {
-    std::string buffer;
-    int line_count = 1;
-    std::vector<Token> tokens;
+  // Resumes lexing at byte `index` of `source`, which is on line `line`.
+  Tokenizer(std::string source, size_t index, int line)
+      : m_src(std::move(source)), m_index(index), m_line(line) {}
+  // Reads the source from `input` as tokens are lexed, keeping only a window
+  // of about two chunks in memory.
+  explicit Tokenizer(std::istream& input) : m_input(&input) {}
 
+  // Lexes the next token, skipping whitespace and comments. Returns nothing
+  // at the end of the source.
+  std::optional<Token> next() {
     while (peek().has_value()) {
+      const size_t start = position();
       if (std::isalpha(peek().value())) {
+        std::string buffer;
         buffer.push_back(consume());
         while (peek().has_value() && std::isalnum(peek().value())) {
           buffer.push_back(consume());
         }
 
         if (buffer == "exit") {
-          tokens.push_back({.type = TokenType::_exit, .line = line_count});
-          buffer.clear();
+          return make(TokenType::_exit, start);
         } else if (buffer == "let") {
-          tokens.push_back({.type = TokenType::_let, .line = line_count});
-          buffer.clear();
+          return make(TokenType::_let, start);
         } else if (buffer == "if") {
-          tokens.push_back({.type = TokenType::_if, .line = line_count});
-          buffer.clear();
+          return make(TokenType::_if, start);
         } else if (buffer == "elif") {
-          tokens.push_back({.type = TokenType::_elif, .line = line_count});
-          buffer.clear();
+          return make(TokenType::_elif, start);
         } else if (buffer == "else") {
-          tokens.push_back({.type = TokenType::_else, .line = line_count});
-          buffer.clear();
+          return make(TokenType::_else, start);
         } else {
-          tokens.push_back(
-              {.type = TokenType::_ident, .line = line_count, .value = buffer});
-          buffer.clear();
+          return make(TokenType::_ident, start, std::move(buffer));
         }
       } else if (std::isdigit(peek().value())) {
+        std::string buffer;
         buffer.push_back(consume());
 
         while (peek().has_value() && std::isdigit(peek().value())) {
           buffer.push_back(consume());
         }
 
-        tokens.push_back(
-            {.type = TokenType::_int_lit, .line = line_count, .value = buffer});
-        buffer.clear();
+        return make(TokenType::_int_lit, start, std::move(buffer));
       } else if (peek().value() == '/' && peek(1).has_value() &&
                  peek(1).value() == '/') {
         while (peek().has_value() && peek().value() != '\n') {
@@ -152,53 +196,58 @@ class Tokenizer {
           if (peek().value() == '*' && peek(1).has_value() &&
               peek(1).value() == '/')
             break;
-          if (peek().has_value() && peek().value() == '\n') ++line_count;
+          if (peek().has_value() && peek().value() == '\n') ++m_line;
           consume();
         }
         if (peek().has_value()) consume();
         if (peek().has_value()) consume();
       } else if (peek().value() == '(') {
         consume();
-        tokens.push_back({.type = TokenType::_open_paren, .line = line_count});
+        return make(TokenType::_open_paren, start);
       } else if (peek().value() == ')') {
         consume();
-        tokens.push_back({.type = TokenType::_close_paren, .line = line_count});
+        return make(TokenType::_close_paren, start);
       } else if (peek().value() == ';') {
         consume();
-        tokens.push_back({.type = TokenType::_semi, .line = line_count});
+        return make(TokenType::_semi, start);
       } else if (peek().value() == '=') {
         consume();
-        tokens.push_back({.type = TokenType::_op_eq, .line = line_count});
+        return make(TokenType::_op_eq, start);
       } else if (peek().value() == '+') {
         consume();
-        tokens.push_back({.type = TokenType::_op_add, .line = line_count});
+        return make(TokenType::_op_add, start);
       } else if (peek().value() == '*') {
         consume();
-        tokens.push_back({.type = TokenType::_op_mul, .line = line_count});
+        return make(TokenType::_op_mul, start);
       } else if (peek().value() == '-') {
         consume();
-        tokens.push_back({.type = TokenType::_op_sub, .line = line_count});
+        return make(TokenType::_op_sub, start);
       } else if (peek().value() == '/') {
         consume();
-        tokens.push_back({.type = TokenType::_op_div, .line = line_count});
+        return make(TokenType::_op_div, start);
       } else if (peek().value() == '{') {
         consume();
-        tokens.push_back({.type = TokenType::_open_braces, .line = line_count});
+        return make(TokenType::_open_braces, start);
       } else if (peek().value() == '}') {
         consume();
-        tokens.push_back(
-            {.type = TokenType::_closed_braces, .line = line_count});
+        return make(TokenType::_closed_braces, start);
       } else if (peek().value() == '\n') {
         consume();
-        ++line_count;
+        ++m_line;
       } else if (std::isspace(peek().value())) {
         consume();
       } else {
-        std::cerr << "Invalid token" << std::endl;
-        exit(EXIT_FAILURE);
+        throw CompileError("Invalid token");
       }
     }
-    m_index = 0;
+    return {};
+  }
+
+  std::vector<Token> tokenize() {
+    std::vector<Token> tokens;
+    while (auto token = next()) {
+      tokens.push_back(std::move(token.value()));
+    }
     return tokens;
   }
 };
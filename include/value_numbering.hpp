@@ -0,0 +1,240 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+
+#include "frame.hpp"
+#include "parser.hpp"
+#include "visitor.hpp"
+
+// Local value numbering over the expressions of each basic block. A binary
+// expression whose value is already available in the block is replaced by a
+// load of the first occurrence, which the generator spills into a temporary
+// slot placed after the locals in the frame.
+//
+// Operands are identified by frame slot and version; every let or
+// reassignment of a slot bumps its version, so values computed before the
+// store are never reused after it.
+class ValueNumbering {
+ private:
+  enum class Op { lit, var, add, mul, sub, div };
+  using Key = std::tuple<Op, size_t, size_t>;
+
+  const FrameLayout& m_frame;
+  std::map<Key, size_t> m_numbers{};
+  // Text of each integer literal, numbered so that keys hold no strings.
+  std::unordered_map<std::string, size_t> m_literals{};
+  // Value number of every binary expression numbered so far.
+  std::unordered_map<const NodeBinExpr*, size_t> m_values{};
+  std::unordered_map<size_t, const NodeBinExpr*> m_available{};
+  std::unordered_map<size_t, size_t> m_versions{};
+  std::unordered_map<const NodeBinExpr*, size_t> m_temps{};
+  std::unordered_map<const NodeBinExpr*, const NodeBinExpr*> m_reuse{};
+  size_t m_block_temps = 0;
+  size_t m_temp_slots = 0;
+  size_t m_eliminated = 0;
+
+  size_t number(const Key& key) {
+    auto [it, inserted] = m_numbers.try_emplace(key, m_numbers.size());
+    return it->second;
+  }
+
+  // Value number of an expression, computed bottom-up once per node and
+  // cached for binary expressions. Only assigns numbers, it does not make any
+  // value available.
+  size_t number_expr(const NodeExpr* expr) {
+    if (auto term = std::get_if<NodeTerm*>(&expr->var)) {
+      return number_term(*term);
+    }
+    return number_bin_expr(std::get<NodeBinExpr*>(expr->var));
+  }
+
+  size_t number_term(const NodeTerm* term) {
+    struct TermVisitor {
+      ValueNumbering& vn;
+
+      size_t operator()(const NodeTermIntLit* term_int_lit) const {
+        auto [it, inserted] = vn.m_literals.try_emplace(
+            term_int_lit->int_lit.value.value(), vn.m_literals.size());
+        return vn.number({Op::lit, it->second, 0});
+      }
+      size_t operator()(const NodeTermIdent* term_ident) const {
+        const size_t slot = vn.m_frame.slot_of(term_ident);
+        return vn.number({Op::var, slot, vn.m_versions[slot]});
+      }
+      size_t operator()(const NodeTermParen* term_paren) const {
+        return vn.number_expr(term_paren->expr);
+      }
+    };
+
+    TermVisitor visitor({.vn = *this});
+    return dispatch(term->var, visitor);
+  }
+
+  size_t number_bin_expr(const NodeBinExpr* bin_expr) {
+    struct BinExprVisitor {
+      ValueNumbering& vn;
+
+      size_t commutative(Op op, const NodeExpr* lhs,
+                         const NodeExpr* rhs) const {
+        size_t l = vn.number_expr(lhs);
+        size_t r = vn.number_expr(rhs);
+        return vn.number({op, std::min(l, r), std::max(l, r)});
+      }
+      size_t operator()(const NodeBinExprAdd* add) const {
+        return commutative(Op::add, add->lhs, add->rhs);
+      }
+      size_t operator()(const NodeBinExprMul* mul) const {
+        return commutative(Op::mul, mul->lhs, mul->rhs);
+      }
+      size_t operator()(const NodeBinExprSub* sub) const {
+        return vn.number(
+            {Op::sub, vn.number_expr(sub->lhs), vn.number_expr(sub->rhs)});
+      }
+      size_t operator()(const NodeBinExprDiv* div) const {
+        return vn.number(
+            {Op::div, vn.number_expr(div->lhs), vn.number_expr(div->rhs)});
+      }
+    };
+
+    BinExprVisitor visitor({.vn = *this});
+    const size_t value = dispatch(bin_expr->var, visitor);
+    m_values[bin_expr] = value;
+    return value;
+  }
+
+  // Walks an expression in the order the generator evaluates it (right
+  // operand first) and records which binary expressions can be reused. The
+  // expression has been numbered already.
+  void reuse_expr(const NodeExpr* expr) {
+    if (auto term = std::get_if<NodeTerm*>(&expr->var)) {
+      if (auto term_paren = std::get_if<NodeTermParen*>(&(*term)->var)) {
+        reuse_expr((*term_paren)->expr);
+      }
+      return;
+    }
+
+    const NodeBinExpr* bin_expr = std::get<NodeBinExpr*>(expr->var);
+    const size_t value = m_values.at(bin_expr);
+    if (auto it = m_available.find(value); it != m_available.end()) {
+      if (!m_temps.contains(it->second)) {
+        m_temps[it->second] = m_block_temps++;
+        m_temp_slots = std::max(m_temp_slots, m_block_temps);
+      }
+      m_reuse[bin_expr] = it->second;
+      ++m_eliminated;
+      return;
+    }
+
+    dispatch(bin_expr->var, [&](const auto* bin) {
+      reuse_expr(bin->rhs);
+      reuse_expr(bin->lhs);
+    });
+    m_available[value] = bin_expr;
+  }
+
+  void visit_expr(const NodeExpr* expr) {
+    number_expr(expr);
+    reuse_expr(expr);
+  }
+
+  void assign(size_t slot) { ++m_versions[slot]; }
+
+  void end_block() {
+    m_available.clear();
+    m_block_temps = 0;
+  }
+
+  void visit_scope(const NodeScope* scope) {
+    for (const auto stmt : scope->stmts) {
+      visit_stmt(stmt);
+    }
+  }
+
+  void visit_if_pred(const NodeIfPred* pred) {
+    struct PredVisitor {
+      ValueNumbering& vn;
+
+      void operator()(const NodeIfPredElif* _elif) const {
+        vn.visit_expr(_elif->expr);
+        vn.end_block();
+        vn.visit_scope(_elif->scope);
+        vn.end_block();
+        if (_elif->pred.has_value()) {
+          vn.visit_if_pred(_elif->pred.value());
+        }
+      }
+      void operator()(const NodeIfPredElse* _else) const {
+        vn.visit_scope(_else->scope);
+        vn.end_block();
+      }
+    };
+
+    PredVisitor visitor({.vn = *this});
+    dispatch(pred->var, visitor);
+  }
+
+  void visit_stmt(const NodeStmt* stmt) {
+    struct StmtVisitor {
+      ValueNumbering& vn;
+
+      void operator()(const NodeStmtExit* stmt_exit) const {
+        vn.visit_expr(stmt_exit->expr);
+      }
+      void operator()(const NodeStmtLet* stmt_let) const {
+        vn.visit_expr(stmt_let->expr);
+        vn.assign(vn.m_frame.slot_of(stmt_let));
+      }
+      void operator()(const NodeScope* stmt_scope) const {
+        vn.visit_scope(stmt_scope);
+      }
+      void operator()(const NodeStmtIf* stmt_if) const {
+        vn.visit_expr(stmt_if->expr);
+        vn.end_block();
+        vn.visit_scope(stmt_if->scope);
+        vn.end_block();
+        if (stmt_if->pred.has_value()) {
+          vn.visit_if_pred(stmt_if->pred.value());
+        }
+      }
+      void operator()(const NodeStmtReAssign* assign) const {
+        vn.visit_expr(assign->expr);
+        vn.assign(vn.m_frame.slot_of(assign));
+      }
+    };
+
+    StmtVisitor visitor({.vn = *this});
+    dispatch(stmt->var, visitor);
+  }
+
+ public:
+  ValueNumbering(const NodeProg* prog, const FrameLayout& frame)
+      : m_frame(frame) {
+    for (const NodeStmt* stmt : prog->stmts) {
+      visit_stmt(stmt);
+    }
+  }
+
+  // Earlier occurrence whose value `bin_expr` can load instead of computing.
+  std::optional<const NodeBinExpr*> reuse_of(
+      const NodeBinExpr* bin_expr) const {
+    if (auto it = m_reuse.find(bin_expr); it != m_reuse.end()) {
+      return it->second;
+    }
+    return {};
+  }
+
+  // Temporary slot a reused expression is spilled to, counted from the end
+  // of the locals.
+  std::optional<size_t> temp_of(const NodeBinExpr* bin_expr) const {
+    if (auto it = m_temps.find(bin_expr); it != m_temps.end()) {
+      return it->second;
+    }
+    return {};
+  }
+
+  size_t temp_slots() const { return m_temp_slots; }
+  size_t eliminated() const { return m_eliminated; }
+};
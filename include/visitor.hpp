@@ -0,0 +1,132 @@
+#pragma once
+
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include "parser.hpp"
+
+// Compares the index with each alternative's in turn and calls `visitor` on
+// the one that matches. The comparisons are plain enough for the optimizer
+// to turn into a jump table, and each call is direct, so it can be inlined.
+// The visitor is called without std::invoke, whose wrappers add three stack
+// frames per level of a deep tree in unoptimized builds.
+template <typename Variant, typename Visitor, size_t... I>
+auto dispatch_indexed(const Variant& var, Visitor& visitor,
+                      std::index_sequence<I...>) {
+  using Result = std::invoke_result_t<Visitor&,
+                                      std::variant_alternative_t<0, Variant>>;
+  const size_t index = var.index();
+  if constexpr (std::is_void_v<Result>) {
+    (void)((index == I && (visitor(*std::get_if<I>(&var)), true)) || ...);
+  } else {
+    std::optional<Result> result;
+    (void)((index == I &&
+            (result.emplace(visitor(*std::get_if<I>(&var))), true)) ||
+           ...);
+    return std::move(*result);
+  }
+}
+
+// Calls `visitor` with the node `var` holds.
+template <typename Variant, typename Visitor>
+decltype(auto) dispatch(const Variant& var, Visitor&& visitor) {
+  return dispatch_indexed(
+      var, visitor, std::make_index_sequence<std::variant_size_v<Variant>>());
+}
+
+// Walks a tree depth-first, calling the derived pass's `pre` hook on each
+// node before its children and `post` after them. A pass overloads the hooks
+// only for the nodes it cares about; the others compile to nothing. A `pre`
+// returning false skips the node's children, while its `post` still runs.
+// Children are walked in the order the generated code evaluates them, so the
+// right operand of a binary expression comes before the left one.
+//
+// Passes derive privately and befriend AstWalker<Pass> so the hooks can stay
+// private.
+template <typename Derived>
+class AstWalker {
+ private:
+  Derived& derived() { return static_cast<Derived&>(*this); }
+
+  template <typename Node>
+  bool enter(const Node* node) {
+    if constexpr (requires { derived().pre(node); }) {
+      if constexpr (std::is_same_v<decltype(derived().pre(node)), bool>) {
+        return derived().pre(node);
+      } else {
+        derived().pre(node);
+      }
+    }
+    return true;
+  }
+
+  template <typename Node>
+  void leave(const Node* node) {
+    if constexpr (requires { derived().post(node); }) {
+      derived().post(node);
+    }
+  }
+
+  template <typename Node>
+  void walk_var(const Node* node) {
+    dispatch(node->var, [this](const auto* alt) { walk(alt); });
+  }
+
+  template <typename Bin>
+  void walk_bin(const Bin* bin) {
+    walk(bin->rhs);
+    walk(bin->lhs);
+  }
+
+  void children(const NodeTermIntLit*) {}
+  void children(const NodeTermIdent*) {}
+  void children(const NodeTermParen* term_paren) { walk(term_paren->expr); }
+  void children(const NodeTerm* term) { walk_var(term); }
+  void children(const NodeBinExprAdd* add) { walk_bin(add); }
+  void children(const NodeBinExprMul* mul) { walk_bin(mul); }
+  void children(const NodeBinExprSub* sub) { walk_bin(sub); }
+  void children(const NodeBinExprDiv* div) { walk_bin(div); }
+  void children(const NodeBinExpr* bin_expr) { walk_var(bin_expr); }
+  void children(const NodeExpr* expr) { walk_var(expr); }
+  void children(const NodeStmtExit* stmt_exit) { walk(stmt_exit->expr); }
+  void children(const NodeStmtLet* stmt_let) { walk(stmt_let->expr); }
+  void children(const NodeStmtReAssign* assign) { walk(assign->expr); }
+  void children(const NodeScope* scope) {
+    for (const NodeStmt* stmt : scope->stmts) {
+      walk(stmt);
+    }
+  }
+  void children(const NodeStmtIf* stmt_if) {
+    walk(stmt_if->expr);
+    walk(stmt_if->scope);
+    if (stmt_if->pred.has_value()) {
+      walk(stmt_if->pred.value());
+    }
+  }
+  void children(const NodeIfPredElif* _elif) {
+    walk(_elif->expr);
+    walk(_elif->scope);
+    if (_elif->pred.has_value()) {
+      walk(_elif->pred.value());
+    }
+  }
+  void children(const NodeIfPredElse* _else) { walk(_else->scope); }
+  void children(const NodeIfPred* pred) { walk_var(pred); }
+  void children(const NodeStmt* stmt) { walk_var(stmt); }
+  void children(const NodeProg* prog) {
+    for (const NodeStmt* stmt : prog->stmts) {
+      walk(stmt);
+    }
+  }
+
+ protected:
+  template <typename Node>
+  void walk(const Node* node) {
+    if (enter(node)) {
+      children(node);
+    }
+    leave(node);
+  }
+};
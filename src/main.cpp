@@ -1,46 +1,295 @@
+#include <charconv>
+#include <chrono>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <optional>
 #include <sstream>
+#include <thread>
 #include <vector>
 
+#include "ast_bin.hpp"
+#include "error.hpp"
 #include "generator.hpp"
+#include "incremental.hpp"
 #include "parser.hpp"
+#include "source.hpp"
+#include "stream.hpp"
 #include "tokenizer.hpp"
 
-int main(int argc, char *argv[]) {
-  if (argc != 2) {
+void link() {
+  system("nasm -felf64 out.asm");
+  system("ld -o out out.o");
+}
+
+void assemble(const std::string &assembly) {
+  std::fstream file("out.asm", std::ios::out);
+  file << assembly;
+  file.close();
+
+  link();
+}
+
+void assemble(const IncrementalCompiler &compiler) {
+  std::fstream file("out.asm", std::ios::out);
+  compiler.write_assembly(file);
+  file.close();
+
+  link();
+}
+
+double millis_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// Rebuilds `path` whenever it is saved. The change since the previous
+// version is taken as one edit spanning everything between the common prefix
+// and suffix, and only the statements it touches are compiled again. A save
+// that does not compile is reported and the last good build is kept; the
+// next save is then compiled from scratch.
+[[noreturn]] void watch(const std::string &path,
+                        const GeneratorOptions &options) {
+  std::optional<IncrementalCompiler> compiler;
+  std::string source;
+  std::optional<std::filesystem::file_time_type> modified;
+  for (bool first = true;; first = false) {
+    if (!first) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    std::error_code error;
+    auto time = std::filesystem::last_write_time(path, error);
+    if (error || time == modified) {
+      continue;
+    }
+    modified = time;
+    std::string changed = read_file(path);
+    if (compiler.has_value() && changed == source) {
+      continue;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    try {
+      if (!compiler.has_value()) {
+        compiler.emplace(changed, options);
+        const double compile_ms = millis_since(start);
+        assemble(*compiler);
+        std::cerr << "[WATCH] Built " << path << " in " << millis_since(start)
+                  << " ms (compile " << compile_ms << " ms)" << std::endl;
+      } else {
+        const size_t common = std::min(source.size(), changed.size());
+        size_t prefix = 0;
+        while (prefix < common && source[prefix] == changed[prefix]) {
+          ++prefix;
+        }
+        size_t suffix = 0;
+        while (suffix < common - prefix &&
+               source[source.size() - 1 - suffix] ==
+                   changed[changed.size() - 1 - suffix]) {
+          ++suffix;
+        }
+
+        const IncrementalStats stats = compiler->apply(
+            {.offset = prefix,
+             .removed = source.size() - prefix - suffix,
+             .inserted =
+                 changed.substr(prefix, changed.size() - prefix - suffix)});
+        const double edit_ms = millis_since(start);
+        assemble(*compiler);
+        std::cerr << "[WATCH] Rebuilt in " << millis_since(start)
+                  << " ms (compile " << edit_ms << " ms): relexed "
+                  << stats.relexed_tokens << " tokens, reparsed "
+                  << stats.reparsed_tokens << " tokens, regenerated "
+                  << stats.regenerated_segments << " of "
+                  << compiler->segments() << " statements" << std::endl;
+      }
+    } catch (const CompileError &error) {
+      std::cerr << "[WATCH] " << error.what() << " (keeping the last build)"
+                << std::endl;
+      compiler.reset();
+    }
+    source = std::move(changed);
+  }
+}
+
+// Prints the first of `options`, the ones given on the command line that
+// `mode` cannot honour, and returns whether there was none.
+bool check_options(const std::string &mode,
+                   const std::vector<std::pair<std::string, bool>> &options) {
+  for (const auto &[name, given] : options) {
+    if (given) {
+      std::cerr << mode << " does not support " << name << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+int run(int argc, char *argv[]) {
+  std::optional<std::string> input_path;
+  bool print_stats = false;
+  bool watch_mode = false;
+  bool stream_mode = false;
+  bool pipeline = false;
+  bool from_ast_bin = false;
+  bool jobs_given = false;
+  std::optional<std::string> emit_ast_bin;
+  GeneratorOptions options;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--stats") {
+      print_stats = true;
+    } else if (arg == "--watch") {
+      watch_mode = true;
+    } else if (arg == "--stream") {
+      stream_mode = true;
+    } else if (arg == "--pipeline") {
+      pipeline = true;
+    } else if (arg == "--emit-ast-bin") {
+      emit_ast_bin = "out.ast";
+    } else if (arg.starts_with("--emit-ast-bin=")) {
+      emit_ast_bin = arg.substr(arg.find('=') + 1);
+    } else if (arg == "--from-ast-bin") {
+      from_ast_bin = true;
+    } else if (arg == "--profile-generate") {
+      options.profile_generate = "hydro.prof";
+    } else if (arg.starts_with("--profile-generate=")) {
+      options.profile_generate = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--profile-use=")) {
+      options.profile_use = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--jobs=")) {
+      const std::string value = arg.substr(arg.find('=') + 1);
+      size_t jobs = 0;
+      auto [end, error] =
+          std::from_chars(value.data(), value.data() + value.size(), jobs);
+      if (error != std::errc() || end != value.data() + value.size() ||
+          jobs == 0) {
+        std::cerr << "Invalid value for --jobs: " << value << std::endl;
+        return EXIT_FAILURE;
+      }
+      options.jobs = std::min(jobs, MAX_JOBS);
+      jobs_given = true;
+    } else if (arg.starts_with("--")) {
+      std::cerr << "Unknown option: " << arg << std::endl;
+      return EXIT_FAILURE;
+    } else if (!input_path.has_value()) {
+      input_path = arg;
+    } else {
+      std::cerr << "Multiple input files provided" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!input_path.has_value()) {
     std::cerr << "No input files provided" << std::endl;
     return EXIT_FAILURE;
   }
 
-  std::fstream input(argv[1], std::ios::in);
-  std::stringstream tempBuffer;
-  tempBuffer << input.rdbuf();
+  // Watch and stream mode generate each statement as a fragment, which
+  // rules out profiles and worker threads, and read source text only. A tree
+  // loaded from an AST file has no lexer to pipeline and is generated on the
+  // calling thread.
+  bool supported = true;
+  if (watch_mode || stream_mode) {
+    supported = check_options(
+        watch_mode ? "--watch" : "--stream",
+        {{"--stream", watch_mode && stream_mode},
+         {"profiles", options.profile_generate.has_value() ||
+                          options.profile_use.has_value()},
+         {"AST files", from_ast_bin || emit_ast_bin.has_value()},
+         {"--pipeline", pipeline},
+         {"--jobs", jobs_given}});
+  } else if (from_ast_bin) {
+    supported = check_options("--from-ast-bin", {{"--pipeline", pipeline},
+                                                 {"--jobs", jobs_given}});
+  }
+  if (!supported) {
+    return EXIT_FAILURE;
+  }
 
-  input.close();
+  if (watch_mode) {
+    watch(input_path.value(), options);
+  }
 
-  std::string buffer = tempBuffer.str();
+  if (stream_mode) {
+    std::fstream input(input_path.value(), std::ios::in);
+    std::fstream output("out.asm", std::ios::out);
+    StreamCompiler compiler(input, std::move(options));
+    compiler.compile(output);
+    output.close();
 
-  Tokenizer tokenizer(std::move(buffer));
-  std::vector<Token> tokens = tokenizer.tokenize();
+    if (print_stats) {
+      std::cerr << "[STATS] CSE eliminated expressions: "
+                << compiler.stats().cse_eliminated << std::endl;
+      std::cerr << "[STATS] Streamed statements: " << compiler.statements()
+                << std::endl;
+      std::cerr << "[STATS] Arena bytes: " << compiler.arena_bytes()
+                << std::endl;
+    }
 
-  Parser parser(std::move(tokens));
-  std::optional<NodeProg *> tree = parser.parse_prog();
+    link();
+    return EXIT_SUCCESS;
+  }
+
+  // Owns the tree, whether it was parsed or loaded from an AST file.
+  std::optional<Parser> parser;
+  std::optional<MappedAst> mapped;
+  std::optional<const NodeProg *> tree;
+
+  if (from_ast_bin) {
+    mapped.emplace(input_path.value());
+    tree = mapped->prog();
+  } else if (pipeline) {
+    std::fstream input(input_path.value(), std::ios::in);
+    TokenQueue queue;
+    TokenProducer producer(Tokenizer(input), queue);
+
+    parser.emplace(queue);
+    tree = parser->parse_prog();
+  } else {
+    std::string buffer = read_file(input_path.value());
+
+    Tokenizer tokenizer(std::move(buffer));
+    std::vector<Token> tokens = tokenizer.tokenize();
+
+    parser.emplace(std::move(tokens));
+    tree = parser->parse_prog();
+  }
 
   if (!tree.has_value()) {
     std::cerr << "Parsing failed" << std::endl;
     exit(EXIT_FAILURE);
   }
 
-  Generator generator(tree.value());
+  if (emit_ast_bin.has_value()) {
+    write_ast_bin(tree.value(), emit_ast_bin.value());
+    return EXIT_SUCCESS;
+  }
 
-  std::fstream file("out.asm", std::ios::out);
-  file << generator.gen_prog();
-  file.close();
+  Generator generator(tree.value(), std::move(options));
 
-  system("nasm -felf64 out.asm");
-  system("ld -o out out.o");
+  const std::string assembly = generator.gen_prog();
+
+  if (print_stats) {
+    const CompileStats stats = generator.stats();
+    std::cerr << "[STATS] CSE eliminated expressions: " << stats.cse_eliminated
+              << std::endl;
+    std::cerr << "[STATS] Cold arms moved out of line: " << stats.cold_arms
+              << std::endl;
+  }
+
+  assemble(assembly);
 
   return EXIT_SUCCESS;
 }
+
+int main(int argc, char *argv[]) {
+  try {
+    return run(argc, argv);
+  } catch (const CompileError &error) {
+    std::cerr << error.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+}